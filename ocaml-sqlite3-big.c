@@ -92,3 +92,275 @@ ml_sqlite3_column_blob_big (value s, value i)
   memcpy (Data_bigarray_val(r), data, len);
   CAMLreturn(r);
 }
+
+
+/* Array parameters */
+
+/* An eponymous virtual table ml_array(p) returns the elements of the
+   array bound to the parameter p with one of the bind_*_array
+   functions, passed with sqlite3_bind_pointer. The numeric bigarrays
+   are read in place and kept alive in the list above until SQLite
+   releases the binding; the strings of an OCaml array are copied,
+   since the GC may move them. */
+
+#ifdef HAVE_SQLITE3_BIND_POINTER
+
+enum { ML_ARRAY_INT64, ML_ARRAY_DOUBLE, ML_ARRAY_TEXT };
+
+struct ml_sqlite3_array {
+  int type;
+  sqlite3_int64 n;
+  void *data;			/* bigarray data or char *[n] */
+  int *lens;			/* text only */
+};
+
+static void
+ml_sqlite3_array_free (void *p)
+{
+  struct ml_sqlite3_array *a = p;
+  if (a->type != ML_ARRAY_TEXT)
+    ml_sqlite3_release_big (a->data);
+  sqlite3_free (a);
+}
+
+static void
+ml_sqlite3_bind_array (sqlite3_stmt *stmt, value idx, struct ml_sqlite3_array *a)
+{
+  int status;
+  status = sqlite3_bind_pointer (stmt, Int_val (idx), a,
+				 "ml_array", ml_sqlite3_array_free);
+  if (status != SQLITE_OK)
+    ml_sqlite3_raise_exn (status, "sqlite3_bind failed", TRUE);
+}
+
+static void
+ml_sqlite3_bind_big_array (value s, value idx, value v, int type)
+{
+  CAMLparam3(s, idx, v);
+  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
+  struct ml_sqlite3_array *a;
+  a = sqlite3_malloc (sizeof *a);
+  if (a == NULL)
+    caml_raise_out_of_memory ();
+  a->type = type;
+  a->n    = Bigarray_val (v)->dim[0];
+  a->data = Data_bigarray_val (v);
+  a->lens = NULL;
+  /* registered first, the destructor may be called if binding fails */
+  ml_sqlite3_register_big (v);
+  ml_sqlite3_bind_array (stmt, idx, a);
+  CAMLreturn0;
+}
+#endif
+
+CAMLprim value
+ml_sqlite3_bind_int64_array (value s, value idx, value v)
+{
+#ifdef HAVE_SQLITE3_BIND_POINTER
+  ml_sqlite3_bind_big_array (s, idx, v, ML_ARRAY_INT64);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_bind_pointer unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_bind_float_array (value s, value idx, value v)
+{
+#ifdef HAVE_SQLITE3_BIND_POINTER
+  ml_sqlite3_bind_big_array (s, idx, v, ML_ARRAY_DOUBLE);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_bind_pointer unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_bind_text_array (value s, value idx, value v)
+{
+#ifdef HAVE_SQLITE3_BIND_POINTER
+  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
+  struct ml_sqlite3_array *a;
+  mlsize_t i, n = Wosize_val (v);
+  size_t size = 0;
+  char **strs, *p;
+
+  for (i=0; i<n; i++)
+    size += caml_string_length (Field (v, i));
+  a = sqlite3_malloc64 (sizeof *a + n * (sizeof (char *) + sizeof (int)) + size);
+  if (a == NULL)
+    caml_raise_out_of_memory ();
+  strs = (char **) (a + 1);
+  a->type = ML_ARRAY_TEXT;
+  a->n    = n;
+  a->data = strs;
+  a->lens = (int *) (strs + n);
+  p = (char *) (a->lens + n);
+  for (i=0; i<n; i++)
+    {
+      value str = Field (v, i);
+      a->lens[i] = caml_string_length (str);
+      memcpy (p, String_val (str), a->lens[i]);
+      strs[i] = p;
+      p += a->lens[i];
+    }
+  ml_sqlite3_bind_array (stmt, idx, a);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_bind_pointer unavailable");
+#endif
+}
+
+#ifdef HAVE_SQLITE3_BIND_POINTER
+struct ml_sqlite3_array_cursor {
+  sqlite3_vtab_cursor base;
+  struct ml_sqlite3_array *a;
+  sqlite3_int64 i;
+};
+
+static int
+ml_array_connect (sqlite3 *db, void *aux, int argc, const char *const *argv,
+		  sqlite3_vtab **vtab, char **err)
+{
+  int status = sqlite3_declare_vtab (db, "CREATE TABLE x(value, arr HIDDEN)");
+  if (status != SQLITE_OK)
+    return status;
+  *vtab = sqlite3_malloc (sizeof **vtab);
+  if (*vtab == NULL)
+    return SQLITE_NOMEM;
+  memset (*vtab, 0, sizeof **vtab);
+  return SQLITE_OK;
+}
+
+static int
+ml_array_disconnect (sqlite3_vtab *vtab)
+{
+  sqlite3_free (vtab);
+  return SQLITE_OK;
+}
+
+/* without an array argument, the table is empty */
+static int
+ml_array_best_index (sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  int i;
+  info->idxNum = 0;
+  info->estimatedCost = 1e9;
+  for (i=0; i<info->nConstraint; i++)
+    if (info->aConstraint[i].iColumn == 1
+	&& info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ
+	&& info->aConstraint[i].usable)
+      {
+	info->aConstraintUsage[i].argvIndex = 1;
+	info->aConstraintUsage[i].omit = 1;
+	info->idxNum = 1;
+	info->estimatedCost = 100;
+	break;
+      }
+  return SQLITE_OK;
+}
+
+static int
+ml_array_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **cur)
+{
+  struct ml_sqlite3_array_cursor *c = sqlite3_malloc (sizeof *c);
+  if (c == NULL)
+    return SQLITE_NOMEM;
+  memset (c, 0, sizeof *c);
+  *cur = &c->base;
+  return SQLITE_OK;
+}
+
+static int
+ml_array_close (sqlite3_vtab_cursor *cur)
+{
+  sqlite3_free (cur);
+  return SQLITE_OK;
+}
+
+static int
+ml_array_filter (sqlite3_vtab_cursor *cur, int idx_num, const char *idx_str,
+		 int argc, sqlite3_value **argv)
+{
+  struct ml_sqlite3_array_cursor *c = (struct ml_sqlite3_array_cursor *) cur;
+  c->a = idx_num == 1 ? sqlite3_value_pointer (argv[0], "ml_array") : NULL;
+  c->i = 0;
+  return SQLITE_OK;
+}
+
+static int
+ml_array_next (sqlite3_vtab_cursor *cur)
+{
+  ((struct ml_sqlite3_array_cursor *) cur)->i++;
+  return SQLITE_OK;
+}
+
+static int
+ml_array_eof (sqlite3_vtab_cursor *cur)
+{
+  struct ml_sqlite3_array_cursor *c = (struct ml_sqlite3_array_cursor *) cur;
+  return c->a == NULL || c->i >= c->a->n;
+}
+
+/* the binding can't change while the statement runs, the texts are static */
+static int
+ml_array_column (sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+{
+  struct ml_sqlite3_array_cursor *c = (struct ml_sqlite3_array_cursor *) cur;
+  struct ml_sqlite3_array *a = c->a;
+  if (col != 0)
+    return SQLITE_OK;
+  switch (a->type)
+    {
+    case ML_ARRAY_INT64:
+      sqlite3_result_int64 (ctx, ((sqlite3_int64 *) a->data)[c->i]);
+      break;
+    case ML_ARRAY_DOUBLE:
+      sqlite3_result_double (ctx, ((double *) a->data)[c->i]);
+      break;
+    case ML_ARRAY_TEXT:
+      sqlite3_result_text (ctx, ((char **) a->data)[c->i], a->lens[c->i],
+			   SQLITE_STATIC);
+      break;
+    }
+  return SQLITE_OK;
+}
+
+static int
+ml_array_rowid (sqlite3_vtab_cursor *cur, sqlite3_int64 *rowid)
+{
+  *rowid = ((struct ml_sqlite3_array_cursor *) cur)->i + 1;
+  return SQLITE_OK;
+}
+
+static sqlite3_module ml_array_module = {
+  0,				/* iVersion */
+  NULL,				/* xCreate: eponymous only */
+  ml_array_connect,
+  ml_array_best_index,
+  ml_array_disconnect,
+  ml_array_disconnect,
+  ml_array_open,
+  ml_array_close,
+  ml_array_filter,
+  ml_array_next,
+  ml_array_eof,
+  ml_array_column,
+  ml_array_rowid,
+};
+#endif
+
+CAMLprim value
+ml_sqlite3_array_register (value db)
+{
+#ifdef HAVE_SQLITE3_BIND_POINTER
+  int status;
+  status = sqlite3_create_module (Sqlite3_val (db), "ml_array",
+				  &ml_array_module, NULL);
+  if (status != SQLITE_OK)
+    raise_sqlite3_exn (db);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_bind_pointer unavailable");
+#endif
+}
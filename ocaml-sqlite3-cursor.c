@@ -0,0 +1,538 @@
+#include <string.h>
+
+#define CAML_NAME_SPACE
+
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/custom.h>
+#include <caml/signals.h>
+
+#include <sqlite3.h>
+
+#include "ocaml-sqlite3.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Prefetching cursors: the statement runs on its own connection, in a
+   C thread that copies the rows into a ring of batches. The OCaml side
+   converts a whole batch at once while the thread fills the next
+   ones; the thread blocks when all the batches are full. The time limit
+   and the cancel tokens of the original connection apply to the
+   statement, through a progress handler on the cursor connection. */
+
+#ifdef HAVE_PTHREAD
+
+struct ml_sqlite3_cell {
+  int type;
+  union {
+    sqlite3_int64 i;
+    double d;
+    struct {
+      size_t off;
+      int len;
+    } s;
+  } v;
+};
+
+struct ml_sqlite3_batch {
+  struct ml_sqlite3_cell *cells;
+  int cells_cap;
+  char *arena;
+  size_t arena_len;
+  size_t arena_cap;
+  int rows;
+  int final;			/* no batch after this one */
+  int status;			/* SQLITE_DONE or the error code */
+  char *errmsg;
+};
+
+struct ml_sqlite3_cursor {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  int ncols;
+  int batch_size;
+  int depth;
+  struct ml_sqlite3_batch *ring;
+  int head;			/* next batch for the consumer */
+  int count;			/* filled batches */
+  int stop;
+  int started;
+  int busy;			/* next is waiting for a batch */
+  int closed;			/* closed during next, freed by it */
+  volatile int timed_out;
+  struct ml_sqlite3_watch *watch; /* of the original connection */
+  sqlite3_int64 deadline;	/* from the time limit when opened */
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static int
+ml_sqlite3_batch_add_row (struct ml_sqlite3_cursor *c,
+			  struct ml_sqlite3_batch *b)
+{
+  int i, n = (b->rows + 1) * c->ncols;
+  if (n > b->cells_cap)
+    {
+      struct ml_sqlite3_cell *cells;
+      int cap = b->cells_cap ? 2 * b->cells_cap : c->batch_size * c->ncols;
+      cells = sqlite3_realloc (b->cells, cap * sizeof *cells);
+      if (cells == NULL)
+	return SQLITE_NOMEM;
+      b->cells = cells;
+      b->cells_cap = cap;
+    }
+  for (i=0; i<c->ncols; i++)
+    {
+      struct ml_sqlite3_cell *cell = &b->cells[b->rows * c->ncols + i];
+      cell->type = sqlite3_column_type (c->stmt, i);
+      switch (cell->type)
+	{
+	case SQLITE_INTEGER:
+	  cell->v.i = sqlite3_column_int64 (c->stmt, i);
+	  break;
+	case SQLITE_FLOAT:
+	  cell->v.d = sqlite3_column_double (c->stmt, i);
+	  break;
+	case SQLITE_TEXT:
+	case SQLITE_BLOB:
+	  {
+	    const void *data = cell->type == SQLITE_TEXT
+	      ? (const void *) sqlite3_column_text (c->stmt, i)
+	      : sqlite3_column_blob (c->stmt, i);
+	    int len = sqlite3_column_bytes (c->stmt, i);
+	    if (b->arena_len + len > b->arena_cap)
+	      {
+		char *arena;
+		size_t cap = b->arena_cap ? b->arena_cap : 4096;
+		while (cap < b->arena_len + len)
+		  cap *= 2;
+		arena = sqlite3_realloc64 (b->arena, cap);
+		if (arena == NULL)
+		  return SQLITE_NOMEM;
+		b->arena = arena;
+		b->arena_cap = cap;
+	      }
+	    if (len > 0)
+	      memcpy (b->arena + b->arena_len, data, len);
+	    cell->v.s.off = b->arena_len;
+	    cell->v.s.len = len;
+	    b->arena_len += len;
+	    break;
+	  }
+	}
+    }
+  b->rows++;
+  return SQLITE_OK;
+}
+
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+static int
+ml_sqlite3_cursor_progress_cb (void *data)
+{
+  struct ml_sqlite3_cursor *c = data;
+  int timed_out = FALSE;
+  if (! ml_sqlite3_watch_expired (c->watch, c->deadline, &timed_out))
+    return 0;
+  if (timed_out)
+    c->timed_out = TRUE;
+  return 1;
+}
+#endif
+
+static void *
+ml_sqlite3_cursor_thread (void *data)
+{
+  struct ml_sqlite3_cursor *c = data;
+  struct ml_sqlite3_batch *b;
+  int status = SQLITE_ROW;
+
+  while (status == SQLITE_ROW)
+    {
+      pthread_mutex_lock (&c->mutex);
+      while (c->count == c->depth && ! c->stop)
+	pthread_cond_wait (&c->cond, &c->mutex);
+      if (c->stop)
+	{
+	  pthread_mutex_unlock (&c->mutex);
+	  break;
+	}
+      b = &c->ring[(c->head + c->count) % c->depth];
+      pthread_mutex_unlock (&c->mutex);
+
+      b->rows = 0;
+      b->arena_len = 0;
+      while (b->rows < c->batch_size
+	     && (status = sqlite3_step (c->stmt)) == SQLITE_ROW)
+	{
+	  int r = ml_sqlite3_batch_add_row (c, b);
+	  if (r != SQLITE_OK)
+	    {
+	      status = r;
+	      break;
+	    }
+	}
+      if (status != SQLITE_ROW)
+	{
+	  b->final = TRUE;
+	  b->status = status;
+	  if (status != SQLITE_DONE)
+	    b->errmsg = sqlite3_mprintf ("%s", status == SQLITE_NOMEM
+					 ? "out of memory"
+					 : sqlite3_errmsg (c->db));
+	}
+
+      pthread_mutex_lock (&c->mutex);
+      c->count++;
+      pthread_cond_broadcast (&c->cond);
+      pthread_mutex_unlock (&c->mutex);
+    }
+  return NULL;
+}
+
+static void
+ml_sqlite3_cursor_free (struct ml_sqlite3_cursor *c)
+{
+  int i;
+  if (c->started)
+    {
+      pthread_mutex_lock (&c->mutex);
+      c->stop = TRUE;
+      pthread_cond_broadcast (&c->cond);
+      pthread_mutex_unlock (&c->mutex);
+      sqlite3_interrupt (c->db);
+      pthread_join (c->thread, NULL);
+    }
+  sqlite3_finalize (c->stmt);
+  sqlite3_close (c->db);
+  for (i=0; i<c->depth; i++)
+    {
+      sqlite3_free (c->ring[i].cells);
+      sqlite3_free (c->ring[i].arena);
+      sqlite3_free (c->ring[i].errmsg);
+    }
+  sqlite3_free (c->ring);
+  pthread_cond_destroy (&c->cond);
+  pthread_mutex_destroy (&c->mutex);
+  sqlite3_free (c);
+}
+
+#define Cursor_val(v)	(* ((struct ml_sqlite3_cursor **) Data_custom_val(v)))
+
+static struct ml_sqlite3_cursor *
+ml_sqlite3_cursor_get (value v)
+{
+  struct ml_sqlite3_cursor *c = Cursor_val (v);
+  if (c == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "closed cursor", TRUE);
+  return c;
+}
+
+static void
+ml_finalize_cursor (value v)
+{
+  struct ml_sqlite3_cursor *c = Cursor_val (v);
+  if (c != NULL)
+    {
+      struct ml_sqlite3_watch *w = c->watch;
+      ml_sqlite3_cursor_free (c);
+      ml_sqlite3_watch_release (w);
+    }
+}
+
+#endif /* HAVE_PTHREAD */
+
+CAMLprim value
+ml_sqlite3_cursor_open (value db, value sql, value batch, value depth)
+{
+#ifdef HAVE_PTHREAD
+  static struct custom_operations ops = {
+    "mlsqlite3/cursor/001",
+    ml_finalize_cursor,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+#ifdef custom_compare_ext_default
+    custom_compare_ext_default
+#endif
+  };
+  CAMLparam2(db, sql);
+  CAMLlocal1(v);
+  struct ml_sqlite3_cursor *c;
+  const char *filename;
+  sqlite3_vfs *vfs = NULL;
+  sqlite3 *s_db;
+  int status;
+
+  if (Long_val (batch) <= 0 || Long_val (depth) <= 0)
+    caml_invalid_argument ("Sqlite3_cursor.create");
+#ifdef HAVE_SQLITE3_DB_FILENAME
+  filename = sqlite3_db_filename (Sqlite3_val (db), "main");
+#else
+  caml_failwith ("sqlite3_db_filename unavailable");
+#endif
+  if (filename == NULL || filename[0] == '\0')
+    caml_invalid_argument ("Sqlite3_cursor.create: not a database file");
+
+#ifdef SQLITE_FCNTL_VFS_POINTER
+  /* same VFS as db, for the memory VFS */
+  if (sqlite3_file_control (Sqlite3_val (db), "main",
+			    SQLITE_FCNTL_VFS_POINTER, &vfs) != SQLITE_OK)
+    vfs = NULL;
+#endif
+  status = sqlite3_open_v2 (filename, &s_db, SQLITE_OPEN_READONLY,
+			    vfs ? vfs->zName : NULL);
+  if (status != SQLITE_OK)
+    {
+      char *errmsg = sqlite3_mprintf ("%s", sqlite3_errmsg (s_db));
+      sqlite3_close (s_db);
+      ml_sqlite3_raise_exn (status, errmsg, FALSE);
+    }
+
+  c = sqlite3_malloc (sizeof *c);
+  if (c != NULL)
+    {
+      memset (c, 0, sizeof *c);
+      c->ring = sqlite3_malloc (Long_val (depth) * sizeof *c->ring);
+    }
+  if (c == NULL || c->ring == NULL)
+    {
+      sqlite3_free (c);
+      sqlite3_close (s_db);
+      caml_raise_out_of_memory ();
+    }
+  memset (c->ring, 0, Long_val (depth) * sizeof *c->ring);
+  c->db = s_db;
+  c->batch_size = Long_val (batch);
+  c->depth = Long_val (depth);
+  c->watch = ml_sqlite3_watch_ref (db);
+  c->deadline = ml_sqlite3_watch_deadline (c->watch);
+  pthread_mutex_init (&c->mutex, NULL);
+  pthread_cond_init (&c->cond, NULL);
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+  sqlite3_progress_handler (s_db, 1000, ml_sqlite3_cursor_progress_cb, c);
+#endif
+
+  status = sqlite3_prepare_v2 (s_db, String_val (sql), caml_string_length (sql),
+			       &c->stmt, NULL);
+  if (status != SQLITE_OK || c->stmt == NULL)
+    {
+      char *errmsg = sqlite3_mprintf ("%s", status != SQLITE_OK
+				      ? sqlite3_errmsg (s_db) : "empty statement");
+      ml_sqlite3_watch_release (c->watch);
+      ml_sqlite3_cursor_free (c);
+      ml_sqlite3_raise_exn (status != SQLITE_OK ? status : SQLITE_MISUSE,
+			    errmsg, FALSE);
+    }
+  c->ncols = sqlite3_column_count (c->stmt);
+
+  v = caml_alloc_custom (&ops, sizeof c, 1, 10);
+  Cursor_val (v) = c;
+  CAMLreturn (v);
+#else
+  caml_failwith ("Sqlite3_cursor: threads unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_cursor_bind (value v, value idx, value x)
+{
+#ifdef HAVE_PTHREAD
+  struct ml_sqlite3_cursor *c = ml_sqlite3_cursor_get (v);
+  if (c->started)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "cursor already started", TRUE);
+  ml_sqlite3_bind_stmt (c->stmt, idx, x);
+  return Val_unit;
+#else
+  caml_failwith ("Sqlite3_cursor: threads unavailable");
+#endif
+}
+
+/* the statement runs in a transaction opened on the snapshot */
+CAMLprim value
+ml_sqlite3_cursor_snapshot (value v, value snap)
+{
+#if defined(HAVE_PTHREAD) && defined(HAVE_SQLITE3_SNAPSHOT_GET)
+  struct ml_sqlite3_cursor *c = ml_sqlite3_cursor_get (v);
+  sqlite3_snapshot *s = Sqlite3_snapshot_val (snap);
+  int status;
+  if (c->started || ! sqlite3_get_autocommit (c->db))
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "cursor already started", TRUE);
+  if (s == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "freed snapshot", TRUE);
+  status = sqlite3_exec (c->db, "BEGIN", NULL, NULL, NULL);
+  if (status == SQLITE_OK)
+    status = sqlite3_snapshot_open (c->db, "main", s);
+  if (status != SQLITE_OK)
+    {
+      char *errmsg = sqlite3_mprintf ("%s", sqlite3_errmsg (c->db));
+      sqlite3_exec (c->db, "ROLLBACK", NULL, NULL, NULL);
+      ml_sqlite3_raise_exn (status, errmsg, FALSE);
+    }
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_snapshot_get unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_cursor_start (value v)
+{
+#ifdef HAVE_PTHREAD
+  struct ml_sqlite3_cursor *c = ml_sqlite3_cursor_get (v);
+  if (c->started)
+    return Val_unit;
+  if (pthread_create (&c->thread, NULL, ml_sqlite3_cursor_thread, c) != 0)
+    caml_failwith ("Sqlite3_cursor: cannot create thread");
+  c->started = TRUE;
+  return Val_unit;
+#else
+  caml_failwith ("Sqlite3_cursor: threads unavailable");
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static value
+ml_sqlite3_cell_value (struct ml_sqlite3_batch *b, struct ml_sqlite3_cell *cell)
+{
+  CAMLparam0();
+  CAMLlocal2(v, x);
+  value tag;
+  switch (cell->type)
+    {
+    case SQLITE_INTEGER:
+      if (cell->v.i >= Min_long && cell->v.i <= Max_long)
+	{
+	  tag = MLTAG_INT;
+	  x = Val_long (cell->v.i);
+	}
+      else
+	{
+	  tag = MLTAG_INT64;
+	  x = caml_copy_int64 (cell->v.i);
+	}
+      break;
+    case SQLITE_FLOAT:
+      tag = MLTAG_FLOAT;
+      x = caml_copy_double (cell->v.d);
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      tag = cell->type == SQLITE_TEXT ? MLTAG_TEXT : MLTAG_BLOB;
+      x = caml_alloc_string (cell->v.s.len);
+      memcpy (Bp_val (x), b->arena + cell->v.s.off, cell->v.s.len);
+      break;
+    default:
+      CAMLreturn (MLTAG_NULL);
+    }
+  v = caml_alloc_small (2, 0);
+  Field (v, 0) = tag;
+  Field (v, 1) = x;
+  CAMLreturn (v);
+}
+#endif
+
+CAMLprim value
+ml_sqlite3_cursor_next (value v)
+{
+#ifdef HAVE_PTHREAD
+  CAMLparam1(v);
+  CAMLlocal3(r, row, x);
+  struct ml_sqlite3_cursor *c = ml_sqlite3_cursor_get (v);
+  struct ml_sqlite3_batch *b;
+  int i, j;
+
+  if (! c->started)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "cursor not started", TRUE);
+
+  /* c is pinned while the runtime lock is released: a close from
+     another thread only stops the producer and leaves the free to us */
+  c->busy = TRUE;
+  caml_enter_blocking_section ();
+  pthread_mutex_lock (&c->mutex);
+  while (c->count == 0 && ! c->stop)
+    pthread_cond_wait (&c->cond, &c->mutex);
+  b = &c->ring[c->head];
+  pthread_mutex_unlock (&c->mutex);
+  caml_leave_blocking_section ();
+  c->busy = FALSE;
+  if (c->closed)
+    {
+      struct ml_sqlite3_watch *w = c->watch;
+      caml_enter_blocking_section ();
+      ml_sqlite3_cursor_free (c);
+      caml_leave_blocking_section ();
+      ml_sqlite3_watch_release (w);
+      ml_sqlite3_raise_exn (SQLITE_MISUSE, "closed cursor", TRUE);
+    }
+
+  if (b->final && b->rows == 0 && b->status != SQLITE_DONE)
+    {
+      if (b->status == SQLITE_INTERRUPT && c->timed_out)
+	{
+	  c->timed_out = FALSE;
+	  ml_sqlite3_raise_timeout ();
+	}
+      ml_sqlite3_raise_exn (b->status, b->errmsg, TRUE);
+    }
+
+  r = caml_alloc (b->rows, 0);
+  for (i=0; i<b->rows; i++)
+    {
+      row = caml_alloc (c->ncols, 0);
+      for (j=0; j<c->ncols; j++)
+	{
+	  x = ml_sqlite3_cell_value (b, &b->cells[i * c->ncols + j]);
+	  Store_field (row, j, x);
+	}
+      Store_field (r, i, row);
+    }
+
+  /* the final batch stays at the head, empty */
+  b->rows = 0;
+  if (! b->final)
+    {
+      pthread_mutex_lock (&c->mutex);
+      c->head = (c->head + 1) % c->depth;
+      c->count--;
+      pthread_cond_broadcast (&c->cond);
+      pthread_mutex_unlock (&c->mutex);
+    }
+  CAMLreturn (r);
+#else
+  caml_failwith ("Sqlite3_cursor: threads unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_cursor_close (value v)
+{
+#ifdef HAVE_PTHREAD
+  struct ml_sqlite3_cursor *c = Cursor_val (v);
+  if (c != NULL)
+    {
+      struct ml_sqlite3_watch *w = c->watch;
+      Cursor_val (v) = NULL;
+      if (c->busy)
+	{
+	  /* wake the pending next, which frees the cursor */
+	  c->closed = TRUE;
+	  pthread_mutex_lock (&c->mutex);
+	  c->stop = TRUE;
+	  pthread_cond_broadcast (&c->cond);
+	  pthread_mutex_unlock (&c->mutex);
+	  sqlite3_interrupt (c->db);
+	  return Val_unit;
+	}
+      caml_enter_blocking_section ();
+      ml_sqlite3_cursor_free (c);
+      caml_leave_blocking_section ();
+      ml_sqlite3_watch_release (w);
+    }
+#endif
+  return Val_unit;
+}
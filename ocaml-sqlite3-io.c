@@ -0,0 +1,773 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CAML_NAME_SPACE
+
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/callback.h>
+
+#include <sqlite3.h>
+
+#include "ocaml-sqlite3.h"
+
+static void ml_sqlite3_io_raise (int, long, char *) Noreturn;
+
+/* raise Sqlite3_io.Error (line, rows, msg), msg is freed */
+static void
+ml_sqlite3_io_raise (int line, long rows, char *msg)
+{
+  static value *io_exn;
+  CAMLparam0();
+  CAMLlocal2(bucket, s);
+
+  if (io_exn == NULL)
+    {
+      io_exn = caml_named_value ("mlsqlite3_io_exn");
+      if (io_exn == NULL)
+	caml_failwith ("Sqlite3_io exception not registered");
+    }
+  s = caml_copy_string (msg ? msg : "out of memory");
+  sqlite3_free (msg);
+  bucket = caml_alloc_small (4, 0);
+  Field (bucket, 0) = *io_exn;
+  Field (bucket, 1) = Val_int (line);
+  Field (bucket, 2) = Val_long (rows);
+  Field (bucket, 3) = s;
+  caml_raise (bucket);
+  CAMLnoreturn;
+}
+
+
+
+/* Import */
+
+/* The file is mapped copy-on-write, fields are bound with
+   SQLITE_STATIC directly from the mapping. Quoted fields containing
+   doubled quotes are unescaped in place, which only copies the pages
+   where this happens. */
+
+struct ml_sqlite3_import {
+  char *p;			/* current position */
+  char *end;
+  char sep;
+  int quote;
+  char *null;			/* a copy: OCaml code may run in step */
+  size_t null_len;
+  int line;
+};
+
+#define IMPORT_FIELD	1	/* field followed by a separator */
+#define IMPORT_LAST	2	/* last field of the record */
+#define IMPORT_ERROR	3
+
+static int
+ml_sqlite3_import_field (struct ml_sqlite3_import *im,
+			 char **field, int *len, int *quoted)
+{
+  char *p = im->p, *end = im->end;
+
+  *quoted = FALSE;
+  if (im->quote && p < end && *p == '"')
+    {
+      char *w;
+      p++;
+      *field = w = p;
+      for (;;)
+	{
+	  if (p == end)
+	    return IMPORT_ERROR;
+	  if (*p == '"')
+	    {
+	      if (p + 1 < end && p[1] == '"')
+		{
+		  if (w != p)
+		    *w = '"';
+		  w++;
+		  p += 2;
+		  continue;
+		}
+	      p++;
+	      break;
+	    }
+	  if (*p == '\n')
+	    im->line++;
+	  if (w != p)
+	    *w = *p;
+	  w++;
+	  p++;
+	}
+      *len = w - *field;
+      *quoted = TRUE;
+    }
+  else
+    {
+      *field = p;
+      while (p < end && *p != im->sep && *p != '\n')
+	p++;
+      *len = p - *field;
+      if (*len > 0 && p[-1] == '\r' && (p == end || *p == '\n'))
+	(*len)--;
+    }
+
+  if (p < end && *p == im->sep)
+    {
+      im->p = p + 1;
+      return IMPORT_FIELD;
+    }
+  if (p < end && *p == '\r')
+    p++;
+  if (p < end && *p == '\n')
+    {
+      im->line++;
+      im->p = p + 1;
+      return IMPORT_LAST;
+    }
+  if (p == end)
+    {
+      im->p = p;
+      return IMPORT_LAST;
+    }
+  return IMPORT_ERROR;
+}
+
+static int
+ml_sqlite3_import_exec (sqlite3 *db, const char *sql, char **errmsg)
+{
+  int status = sqlite3_exec (db, sql, NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+    *errmsg = sqlite3_mprintf ("%s: %s", sql, sqlite3_errmsg (db));
+  return status;
+}
+
+CAMLprim value
+ml_sqlite3_import (value s, value sep, value quote, value header,
+		   value null, value batch, value path)
+{
+  CAMLparam5(s, sep, quote, header, null);
+  CAMLxparam2(batch, path);
+  CAMLlocal2(r, rate);
+  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
+  sqlite3 *db = sqlite3_db_handle (stmt);
+  struct ml_sqlite3_import im;
+  struct stat st;
+  char *map = NULL, *errmsg = NULL;
+  int fd, nparams, in_txn = FALSE, error_line = 0;
+  int step_status = SQLITE_DONE, feed_mark = -1;
+  int skip_header = Bool_val (header);
+  long rows = 0, kept = 0, n_batch = Long_val (batch);
+  sqlite3_int64 start;
+  double elapsed;
+
+  if (n_batch <= 0)
+    caml_invalid_argument ("Sqlite3_io.import");
+  fd = open (String_val (path), O_RDONLY);
+  if (fd < 0)
+    ml_sqlite3_io_raise (0, 0, sqlite3_mprintf ("%s: %s", String_val (path), strerror (errno)));
+  if (fstat (fd, &st) < 0)
+    {
+      errmsg = sqlite3_mprintf ("%s: %s", String_val (path), strerror (errno));
+      close (fd);
+      ml_sqlite3_io_raise (0, 0, errmsg);
+    }
+  if (st.st_size > 0)
+    {
+      map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+	{
+	  errmsg = sqlite3_mprintf ("%s: %s", String_val (path), strerror (errno));
+	  close (fd);
+	  ml_sqlite3_io_raise (0, 0, errmsg);
+	}
+#ifdef MADV_SEQUENTIAL
+      madvise (map, st.st_size, MADV_SEQUENTIAL);
+#endif
+    }
+  close (fd);
+
+  im.p = map;
+  im.end = map + st.st_size;
+  im.sep = Int_val (sep);
+  im.quote = Bool_val (quote);
+  im.null = NULL;
+  im.null_len = 0;
+  if (Is_block (null))
+    {
+      im.null_len = caml_string_length (Field (null, 0));
+      im.null = sqlite3_malloc (im.null_len + 1);
+      if (im.null == NULL)
+	{
+	  if (map != NULL)
+	    munmap (map, st.st_size);
+	  caml_raise_out_of_memory ();
+	}
+      memcpy (im.null, String_val (Field (null, 0)), im.null_len);
+    }
+  im.line = 1;
+  nparams = sqlite3_bind_parameter_count (stmt);
+  start = ml_sqlite3_now ();
+  sqlite3_reset (stmt);
+  ml_sqlite3_step_start (s);
+
+  while (im.p < im.end)
+    {
+      int i, k, len, quoted, status;
+      char *field;
+      int line = im.line;
+
+      if (*im.p == '\n' || (*im.p == '\r' && im.p + 1 < im.end && im.p[1] == '\n'))
+	{
+	  /* skip empty lines */
+	  im.p += *im.p == '\n' ? 1 : 2;
+	  im.line++;
+	  continue;
+	}
+
+      i = 0;
+      do
+	{
+	  k = ml_sqlite3_import_field (&im, &field, &len, &quoted);
+	  if (k == IMPORT_ERROR)
+	    {
+	      errmsg = sqlite3_mprintf ("malformed field %d", i + 1);
+	      break;
+	    }
+	  i++;
+	  if (i > nparams)
+	    continue;
+	  if (im.null && ! quoted && (size_t) len == im.null_len
+	      && memcmp (field, im.null, len) == 0)
+	    status = sqlite3_bind_null (stmt, i);
+	  else
+	    status = sqlite3_bind_text (stmt, i, field, len, SQLITE_STATIC);
+	  if (status != SQLITE_OK)
+	    {
+	      errmsg = sqlite3_mprintf ("%s", sqlite3_errmsg (db));
+	      break;
+	    }
+	}
+      while (k == IMPORT_FIELD);
+
+      if (errmsg == NULL && i != nparams)
+	errmsg = sqlite3_mprintf ("expected %d fields, found %d", nparams, i);
+      if (errmsg != NULL)
+	{
+	  error_line = line;
+	  break;
+	}
+      if (skip_header)
+	{
+	  skip_header = FALSE;
+	  continue;
+	}
+
+      if (! in_txn)
+	{
+	  feed_mark = ml_sqlite3_feed_mark (s);
+	  if (ml_sqlite3_import_exec (db, "SAVEPOINT sqlite3_import", &errmsg) != SQLITE_OK)
+	    {
+	      error_line = line;
+	      break;
+	    }
+	  in_txn = TRUE;
+	}
+      status = sqlite3_step (stmt);
+      if (status != SQLITE_DONE)
+	{
+	  step_status = status;
+	  sqlite3_reset (stmt);
+	  errmsg = sqlite3_mprintf ("%s", sqlite3_errmsg (db));
+	  error_line = line;
+	  break;
+	}
+      sqlite3_reset (stmt);
+      rows++;
+      if (rows % n_batch == 0)
+	{
+	  if (ml_sqlite3_import_exec (db, "RELEASE sqlite3_import", &errmsg) != SQLITE_OK)
+	    {
+	      error_line = line;
+	      break;
+	    }
+	  in_txn = FALSE;
+	  kept = rows;
+	}
+    }
+
+  if (in_txn
+      && (errmsg != NULL
+	  || ml_sqlite3_import_exec (db, "RELEASE sqlite3_import", &errmsg) != SQLITE_OK))
+    {
+      /* the rollback hook isn't called for ROLLBACK TO: drop the
+	 changes of the batch from the feed */
+      sqlite3_exec (db, "ROLLBACK TO sqlite3_import", NULL, NULL, NULL);
+      ml_sqlite3_feed_rewind (s, feed_mark);
+      sqlite3_exec (db, "RELEASE sqlite3_import", NULL, NULL, NULL);
+    }
+  else
+    kept = rows;
+  sqlite3_free (im.null);
+  /* the bindings point into the mapping */
+#ifdef HAVE_SQLITE3_CLEAR_BINDINGS
+  sqlite3_clear_bindings (stmt);
+#else
+  {
+    int i;
+    for (i=1; i<=nparams; i++)
+      sqlite3_bind_null (stmt, i);
+  }
+#endif
+  if (map != NULL)
+    munmap (map, st.st_size);
+  if (step_status == SQLITE_INTERRUPT && ml_sqlite3_interrupt_pending (s))
+    {
+      sqlite3_free (errmsg);
+      ml_sqlite3_step_result (s, step_status);
+    }
+  if (errmsg != NULL)
+    ml_sqlite3_io_raise (error_line, kept, errmsg);
+
+  elapsed = (ml_sqlite3_now () - start) * 1e-9;
+  rate = caml_copy_double (elapsed > 0 ? rows / elapsed : 0.);
+  r = caml_alloc_small (2, 0);
+  Field (r, 0) = Val_long (rows);
+  Field (r, 1) = rate;
+  CAMLreturn (r);
+}
+
+CAMLprim value
+ml_sqlite3_import_bc (value *argv, int argn)
+{
+  return ml_sqlite3_import (argv[0], argv[1], argv[2], argv[3],
+			    argv[4], argv[5], argv[6]);
+}
+
+
+
+/* Export */
+
+/* Rows are serialized into a buffer that is written to the file, or
+   passed to an OCaml writer, whenever it grows past the flush
+   threshold, so memory use does not depend on the size of the result.
+   When exporting to a string, the buffer simply grows. */
+
+struct ml_sqlite3_out {
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t flush;
+  int fd;			/* -1 when exporting to a string or a writer */
+  value *write;			/* the writer, registered by the caller */
+  value *exn;			/* its exception, registered by the caller */
+  sqlite3_int64 total;
+  int err;			/* errno of a failed write, -1 if the writer raised */
+};
+
+#define Out_flushes(o) ((o)->fd >= 0 || (o)->write != NULL)
+
+static void
+ml_sqlite3_out_flush (struct ml_sqlite3_out *o)
+{
+  size_t off = 0;
+  if (o->write != NULL)
+    {
+      value chunk, res;
+      if (o->len == 0 || o->err != 0)
+	return;
+      chunk = caml_alloc_string (o->len);
+      memcpy (Bp_val (chunk), o->buf, o->len);
+      res = caml_callback_exn (*o->write, chunk);
+      if (Is_exception_result (res))
+	{
+	  *o->exn = Extract_exception (res);
+	  o->err = -1;
+	}
+      else
+	o->total += o->len;
+      o->len = 0;
+      return;
+    }
+  while (off < o->len && o->err == 0)
+    {
+      ssize_t n = write (o->fd, o->buf + off, o->len - off);
+      if (n >= 0)
+	off += n;
+      else if (errno != EINTR)
+	o->err = errno;
+    }
+  o->total += off;
+  o->len = 0;
+}
+
+/* the buffer is only flushed between rows, a large row makes it grow */
+static char *
+ml_sqlite3_out_reserve (struct ml_sqlite3_out *o, size_t n)
+{
+  if (o->len + n > o->cap)
+    {
+      size_t cap = o->cap;
+      while (cap < o->len + n)
+	cap *= 2;
+      o->buf = caml_stat_resize (o->buf, cap);
+      o->cap = cap;
+    }
+  return o->buf + o->len;
+}
+
+static void
+ml_sqlite3_out_add (struct ml_sqlite3_out *o, const void *data, size_t n)
+{
+  memcpy (ml_sqlite3_out_reserve (o, n), data, n);
+  o->len += n;
+}
+
+static void
+ml_sqlite3_out_char (struct ml_sqlite3_out *o, char c)
+{
+  *ml_sqlite3_out_reserve (o, 1) = c;
+  o->len++;
+}
+
+static void
+ml_sqlite3_out_hex (struct ml_sqlite3_out *o, const unsigned char *data, int n)
+{
+  static const char digits[] = "0123456789abcdef";
+  char *p = ml_sqlite3_out_reserve (o, 2 * n);
+  int i;
+  for (i=0; i<n; i++)
+    {
+      *p++ = digits[data[i] >> 4];
+      *p++ = digits[data[i] & 0xf];
+    }
+  o->len += 2 * n;
+}
+
+static void
+ml_sqlite3_out_uint (struct ml_sqlite3_out *o, sqlite3_uint64 v, int bytes)
+{
+  char *p = ml_sqlite3_out_reserve (o, bytes);
+  int i;
+  for (i=0; i<bytes; i++)
+    p[i] = (v >> (8 * i)) & 0xff;
+  o->len += bytes;
+}
+
+static void
+ml_sqlite3_out_csv_text (struct ml_sqlite3_out *o, const char *s, int n)
+{
+  int i;
+  for (i=0; i<n; i++)
+    if (s[i] == ',' || s[i] == '"' || s[i] == '\r' || s[i] == '\n')
+      break;
+  if (i == n)
+    {
+      ml_sqlite3_out_add (o, s, n);
+      return;
+    }
+  ml_sqlite3_out_char (o, '"');
+  for (i=0; i<n; i++)
+    {
+      if (s[i] == '"')
+	ml_sqlite3_out_char (o, '"');
+      ml_sqlite3_out_char (o, s[i]);
+    }
+  ml_sqlite3_out_char (o, '"');
+}
+
+static void
+ml_sqlite3_out_json_text (struct ml_sqlite3_out *o, const char *s, int n)
+{
+  int i;
+  ml_sqlite3_out_char (o, '"');
+  for (i=0; i<n; i++)
+    {
+      unsigned char c = s[i];
+      switch (c)
+	{
+	case '"':  ml_sqlite3_out_add (o, "\\\"", 2); break;
+	case '\\': ml_sqlite3_out_add (o, "\\\\", 2); break;
+	case '\n': ml_sqlite3_out_add (o, "\\n", 2); break;
+	case '\r': ml_sqlite3_out_add (o, "\\r", 2); break;
+	case '\t': ml_sqlite3_out_add (o, "\\t", 2); break;
+	default:
+	  if (c < 0x20)
+	    {
+	      char esc[7];
+	      sprintf (esc, "\\u%04x", c);
+	      ml_sqlite3_out_add (o, esc, 6);
+	    }
+	  else
+	    ml_sqlite3_out_char (o, c);
+	}
+    }
+  ml_sqlite3_out_char (o, '"');
+}
+
+#define MLTAG_CSV          6700877L
+#define MLTAG_JSON      1649546321L
+#define MLTAG_BINARY    1058852867L
+
+static void
+ml_sqlite3_export_row (struct ml_sqlite3_out *o, sqlite3_stmt *stmt,
+		       value format, int ncols)
+{
+  int i;
+  size_t start = 0;
+
+  if (format == MLTAG_BINARY)
+    {
+      ml_sqlite3_out_reserve (o, 4);
+      start = o->len;
+      o->len += 4;
+    }
+  else if (format == MLTAG_JSON)
+    ml_sqlite3_out_char (o, '{');
+
+  for (i=0; i<ncols; i++)
+    {
+      int t = sqlite3_column_type (stmt, i);
+      if (format == MLTAG_BINARY)
+	{
+	  ml_sqlite3_out_char (o, t);
+	  switch (t)
+	    {
+	    case SQLITE_INTEGER:
+	      ml_sqlite3_out_uint (o, sqlite3_column_int64 (stmt, i), 8);
+	      break;
+	    case SQLITE_FLOAT:
+	      {
+		union { double d; sqlite3_uint64 u; } f;
+		f.d = sqlite3_column_double (stmt, i);
+		ml_sqlite3_out_uint (o, f.u, 8);
+		break;
+	      }
+	    case SQLITE_TEXT:
+	    case SQLITE_BLOB:
+	      {
+		const void *data = sqlite3_column_blob (stmt, i);
+		int n = sqlite3_column_bytes (stmt, i);
+		ml_sqlite3_out_uint (o, n, 4);
+		ml_sqlite3_out_add (o, data, n);
+		break;
+	      }
+	    }
+	  continue;
+	}
+
+      if (i > 0)
+	ml_sqlite3_out_char (o, ',');
+      if (format == MLTAG_JSON)
+	{
+	  const char *name = sqlite3_column_name (stmt, i);
+	  ml_sqlite3_out_json_text (o, name, strlen (name));
+	  ml_sqlite3_out_char (o, ':');
+	}
+      switch (t)
+	{
+	case SQLITE_NULL:
+	  if (format == MLTAG_JSON)
+	    ml_sqlite3_out_add (o, "null", 4);
+	  break;
+	case SQLITE_FLOAT:
+	  if (format == MLTAG_JSON && ! isfinite (sqlite3_column_double (stmt, i)))
+	    {
+	      ml_sqlite3_out_add (o, "null", 4);
+	      break;
+	    }
+	  /* fall through */
+	case SQLITE_INTEGER:
+	  ml_sqlite3_out_add (o, sqlite3_column_text (stmt, i),
+			      sqlite3_column_bytes (stmt, i));
+	  break;
+	case SQLITE_TEXT:
+	  {
+	    const char *s = (const char *) sqlite3_column_text (stmt, i);
+	    int n = sqlite3_column_bytes (stmt, i);
+	    if (format == MLTAG_JSON)
+	      ml_sqlite3_out_json_text (o, s, n);
+	    else
+	      ml_sqlite3_out_csv_text (o, s, n);
+	    break;
+	  }
+	case SQLITE_BLOB:
+	  {
+	    const void *data = sqlite3_column_blob (stmt, i);
+	    int n = sqlite3_column_bytes (stmt, i);
+	    if (format == MLTAG_JSON)
+	      ml_sqlite3_out_char (o, '"');
+	    ml_sqlite3_out_hex (o, data, n);
+	    if (format == MLTAG_JSON)
+	      ml_sqlite3_out_char (o, '"');
+	    break;
+	  }
+	}
+    }
+
+  if (format == MLTAG_BINARY)
+    {
+      size_t n = o->len - start - 4;
+      int k;
+      for (k=0; k<4; k++)
+	o->buf[start + k] = (n >> (8 * k)) & 0xff;
+    }
+  else if (format == MLTAG_JSON)
+    ml_sqlite3_out_add (o, "}\n", 2);
+  else
+    ml_sqlite3_out_char (o, '\n');
+}
+
+/* Step the statement until it's done, serializing the rows into o.
+   Returns the number of rows; raises an exception on error after
+   freeing the buffer and closing the file. An exception of the writer
+   is raised again as is. */
+static long
+ml_sqlite3_export_stmt (struct ml_sqlite3_out *o, value s, sqlite3_stmt *stmt,
+			value format, int header)
+{
+  CAMLparam2(s, format);
+  int i, status, ncols = sqlite3_column_count (stmt);
+  long rows = 0;
+
+  ml_sqlite3_step_start (s);
+  if (header && format == MLTAG_CSV)
+    {
+      for (i=0; i<ncols; i++)
+	{
+	  const char *name = sqlite3_column_name (stmt, i);
+	  if (i > 0)
+	    ml_sqlite3_out_char (o, ',');
+	  ml_sqlite3_out_csv_text (o, name, strlen (name));
+	}
+      ml_sqlite3_out_char (o, '\n');
+    }
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      ml_sqlite3_export_row (o, stmt, format, ncols);
+      rows++;
+      if (Out_flushes (o) && o->len >= o->flush)
+	ml_sqlite3_out_flush (o);
+      if (o->err != 0)
+	break;
+    }
+  if (Out_flushes (o) && o->err == 0)
+    ml_sqlite3_out_flush (o);
+
+  if (status != SQLITE_DONE && o->err == 0)
+    {
+      sqlite3_reset (stmt);
+      caml_stat_free (o->buf);
+      if (o->fd >= 0)
+	close (o->fd);
+      ml_sqlite3_step_result (s, status);
+    }
+  sqlite3_reset (stmt);
+  if (o->fd >= 0 && close (o->fd) < 0 && o->err == 0)
+    o->err = errno;
+  if (o->err < 0)
+    {
+      caml_stat_free (o->buf);
+      caml_raise (*o->exn);
+    }
+  if (o->err != 0)
+    {
+      caml_stat_free (o->buf);
+      ml_sqlite3_io_raise (0, rows, sqlite3_mprintf ("export: %s", strerror (o->err)));
+    }
+  CAMLreturnT (long, rows);
+}
+
+CAMLprim value
+ml_sqlite3_export_file (value s, value format, value header,
+			value flush, value path)
+{
+  CAMLparam5(s, format, header, flush, path);
+  CAMLlocal1(r);
+  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
+  struct ml_sqlite3_out o;
+  long rows;
+
+  if (Long_val (flush) <= 0)
+    caml_invalid_argument ("Sqlite3_io.export");
+  o.fd = open (String_val (path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (o.fd < 0)
+    ml_sqlite3_io_raise (0, 0, sqlite3_mprintf ("%s: %s", String_val (path), strerror (errno)));
+  o.write = NULL;
+  o.exn = NULL;
+  o.flush = Long_val (flush);
+  o.cap = o.flush + 4096;
+  o.buf = caml_stat_alloc (o.cap);
+  o.len = 0;
+  o.total = 0;
+  o.err = 0;
+
+  rows = ml_sqlite3_export_stmt (&o, s, stmt, format, Bool_val (header));
+  caml_stat_free (o.buf);
+  r = caml_alloc_small (2, 0);
+  Field (r, 0) = Val_long (rows);
+  Field (r, 1) = Val_long (o.total);
+  CAMLreturn (r);
+}
+
+CAMLprim value
+ml_sqlite3_export_writer (value s, value format, value header,
+			  value flush, value write)
+{
+  CAMLparam5(s, format, header, flush, write);
+  CAMLlocal2(r, exn);
+  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
+  struct ml_sqlite3_out o;
+  long rows;
+
+  if (Long_val (flush) <= 0)
+    caml_invalid_argument ("Sqlite3_io.export_to");
+  o.fd = -1;
+  o.write = &write;
+  o.exn = &exn;
+  o.flush = Long_val (flush);
+  o.cap = o.flush + 4096;
+  o.buf = caml_stat_alloc (o.cap);
+  o.len = 0;
+  o.total = 0;
+  o.err = 0;
+
+  rows = ml_sqlite3_export_stmt (&o, s, stmt, format, Bool_val (header));
+  caml_stat_free (o.buf);
+  r = caml_alloc_small (2, 0);
+  Field (r, 0) = Val_long (rows);
+  Field (r, 1) = Val_long (o.total);
+  CAMLreturn (r);
+}
+
+CAMLprim value
+ml_sqlite3_export_string (value s, value format, value header)
+{
+  CAMLparam3(s, format, header);
+  CAMLlocal1(r);
+  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
+  struct ml_sqlite3_out o;
+
+  o.fd = -1;
+  o.write = NULL;
+  o.exn = NULL;
+  o.flush = 0;
+  o.cap = 4096;
+  o.buf = caml_stat_alloc (o.cap);
+  o.len = 0;
+  o.total = 0;
+  o.err = 0;
+
+  ml_sqlite3_export_stmt (&o, s, stmt, format, Bool_val (header));
+  r = caml_alloc_string (o.len);
+  memcpy (Bp_val (r), o.buf, o.len);
+  caml_stat_free (o.buf);
+  CAMLreturn (r);
+}
@@ -0,0 +1,776 @@
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#define CAML_NAME_SPACE
+
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+
+#include <sqlite3.h>
+
+#include "ocaml-sqlite3.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* An in-memory VFS. Files are named and kept in a registry shared by
+   all the connections of the process, until they're deleted; they
+   survive the connections that created them. Locks are implemented
+   in memory, following the unix VFS, and the WAL index is shared
+   between the connections of a file, so the WAL mode works.
+
+   The files are stored in chunks of anonymous memory. The chunks are
+   the size of a huge page and aligned on one, but the pages are only
+   allocated by the kernel when they're touched, so small files like
+   journals cost little. The data of a file is protected by a rwlock, the registry,
+   the locks and the WAL index by a global mutex. */
+
+#ifdef HAVE_PTHREAD
+
+#define MEMVFS_CHUNK	(2 << 20)
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+struct memvfs_file {
+  char *name;			/* NULL for temporary files */
+  struct memvfs_file *next;
+  int refs;			/* open handles */
+
+  pthread_rwlock_t rwlock;
+  char **chunks;
+  int nchunks;
+  sqlite3_int64 size;
+
+  /* the following fields are protected by memvfs_mutex */
+  int shared;
+  void *reserved;
+  void *pending;
+  void *exclusive;
+
+  char **regions;
+  int nregions;
+  int region_size;
+  int shm_refs;
+  int shm_shared[SQLITE_SHM_NLOCK];
+  int shm_excl[SQLITE_SHM_NLOCK];
+};
+
+struct memvfs_handle {
+  sqlite3_file base;
+  struct memvfs_file *f;
+  int lock;
+  int delete_on_close;
+  int shm_mapped;
+  unsigned int shm_shared;	/* bitmasks of the WAL index locks held */
+  unsigned int shm_excl;
+};
+
+static pthread_mutex_t memvfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct memvfs_file *memvfs_files;
+
+/* Chunks are mapped with an extra MEMVFS_CHUNK bytes, then trimmed
+   to an aligned address, so that they can be backed by huge pages. */
+static void *
+memvfs_map (size_t size)
+{
+  char *p, *q;
+  size_t extra = size >= MEMVFS_CHUNK ? MEMVFS_CHUNK : 0;
+
+  p = mmap (NULL, size + extra, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  if (extra == 0)
+    return p;
+  q = (char *) (((uintnat) p + MEMVFS_CHUNK - 1) & ~ (uintnat) (MEMVFS_CHUNK - 1));
+  if (q > p)
+    munmap (p, q - p);
+  munmap (q + size, extra - (q - p));
+#ifdef MADV_HUGEPAGE
+  madvise (q, size, MADV_HUGEPAGE);
+#endif
+  return q;
+}
+
+static struct memvfs_file *
+memvfs_find (const char *name)
+{
+  struct memvfs_file *f;
+  for (f = memvfs_files; f != NULL; f = f->next)
+    if (strcmp (f->name, name) == 0)
+      return f;
+  return NULL;
+}
+
+static void
+memvfs_unlink (struct memvfs_file *f)
+{
+  struct memvfs_file **p;
+  for (p = &memvfs_files; *p != NULL; p = &(*p)->next)
+    if (*p == f)
+      {
+	*p = f->next;
+	break;
+      }
+  f->next = NULL;
+}
+
+static void
+memvfs_free_shm (struct memvfs_file *f)
+{
+  int i;
+  for (i=0; i<f->nregions; i++)
+    munmap (f->regions[i], f->region_size);
+  sqlite3_free (f->regions);
+  f->regions = NULL;
+  f->nregions = 0;
+}
+
+static void
+memvfs_free (struct memvfs_file *f)
+{
+  int i;
+  for (i=0; i<f->nchunks; i++)
+    if (f->chunks[i] != NULL)
+      munmap (f->chunks[i], MEMVFS_CHUNK);
+  memvfs_free_shm (f);
+  sqlite3_free (f->chunks);
+  sqlite3_free (f->name);
+  pthread_rwlock_destroy (&f->rwlock);
+  sqlite3_free (f);
+}
+
+/* with the write lock held */
+static char *
+memvfs_chunk (struct memvfs_file *f, int i)
+{
+  if (i >= f->nchunks)
+    {
+      int n = f->nchunks ? f->nchunks : 4;
+      char **chunks;
+      while (n <= i)
+	n *= 2;
+      chunks = sqlite3_realloc (f->chunks, n * sizeof *chunks);
+      if (chunks == NULL)
+	return NULL;
+      memset (chunks + f->nchunks, 0, (n - f->nchunks) * sizeof *chunks);
+      f->chunks = chunks;
+      f->nchunks = n;
+    }
+  if (f->chunks[i] == NULL)
+    f->chunks[i] = memvfs_map (MEMVFS_CHUNK);
+  return f->chunks[i];
+}
+
+
+/* I/O methods */
+
+#define Memvfs_file(p)	(((struct memvfs_handle *) (p))->f)
+
+static int memvfs_unlock (sqlite3_file *, int);
+static int memvfs_shm_unmap (sqlite3_file *, int);
+
+static int
+memvfs_close (sqlite3_file *p)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = h->f;
+  memvfs_unlock (p, SQLITE_LOCK_NONE);
+  memvfs_shm_unmap (p, FALSE);
+  pthread_mutex_lock (&memvfs_mutex);
+  if (h->delete_on_close && f->name != NULL)
+    {
+      memvfs_unlink (f);
+      sqlite3_free (f->name);
+      f->name = NULL;
+    }
+  f->refs--;
+  if (f->refs == 0 && f->name == NULL)
+    memvfs_free (f);
+  pthread_mutex_unlock (&memvfs_mutex);
+  return SQLITE_OK;
+}
+
+static int
+memvfs_read (sqlite3_file *p, void *buf, int amt, sqlite3_int64 off)
+{
+  struct memvfs_file *f = Memvfs_file (p);
+  char *out = buf;
+  int n = 0;
+
+  pthread_rwlock_rdlock (&f->rwlock);
+  while (n < amt && off + n < f->size)
+    {
+      sqlite3_int64 pos = off + n;
+      int i = pos / MEMVFS_CHUNK;
+      int c_off = pos % MEMVFS_CHUNK;
+      int len = MEMVFS_CHUNK - c_off;
+      if (len > amt - n)
+	len = amt - n;
+      if (len > f->size - pos)
+	len = f->size - pos;
+      if (i < f->nchunks && f->chunks[i] != NULL)
+	memcpy (out + n, f->chunks[i] + c_off, len);
+      else
+	memset (out + n, 0, len);
+      n += len;
+    }
+  pthread_rwlock_unlock (&f->rwlock);
+
+  if (n < amt)
+    {
+      memset (out + n, 0, amt - n);
+      return SQLITE_IOERR_SHORT_READ;
+    }
+  return SQLITE_OK;
+}
+
+static int
+memvfs_write (sqlite3_file *p, const void *buf, int amt, sqlite3_int64 off)
+{
+  struct memvfs_file *f = Memvfs_file (p);
+  const char *in = buf;
+  int n = 0;
+
+  pthread_rwlock_wrlock (&f->rwlock);
+  while (n < amt)
+    {
+      sqlite3_int64 pos = off + n;
+      int c_off = pos % MEMVFS_CHUNK;
+      int len = MEMVFS_CHUNK - c_off;
+      char *chunk = memvfs_chunk (f, pos / MEMVFS_CHUNK);
+      if (chunk == NULL)
+	break;
+      if (len > amt - n)
+	len = amt - n;
+      memcpy (chunk + c_off, in + n, len);
+      n += len;
+    }
+  if (off + n > f->size)
+    f->size = off + n;
+  pthread_rwlock_unlock (&f->rwlock);
+  return n < amt ? SQLITE_IOERR_NOMEM : SQLITE_OK;
+}
+
+static int
+memvfs_truncate (sqlite3_file *p, sqlite3_int64 size)
+{
+  struct memvfs_file *f = Memvfs_file (p);
+  int i, keep;
+
+  pthread_rwlock_wrlock (&f->rwlock);
+  if (size < f->size)
+    {
+      keep = (size + MEMVFS_CHUNK - 1) / MEMVFS_CHUNK;
+      for (i=keep; i<f->nchunks; i++)
+	if (f->chunks[i] != NULL)
+	  {
+	    munmap (f->chunks[i], MEMVFS_CHUNK);
+	    f->chunks[i] = NULL;
+	  }
+      /* the tail of the last chunk must read as zeroes if the file grows */
+      if (size % MEMVFS_CHUNK != 0 && keep - 1 < f->nchunks
+	  && f->chunks[keep - 1] != NULL)
+	{
+	  sqlite3_int64 end = f->size - (sqlite3_int64) (keep - 1) * MEMVFS_CHUNK;
+	  if (end > MEMVFS_CHUNK)
+	    end = MEMVFS_CHUNK;
+	  memset (f->chunks[keep - 1] + size % MEMVFS_CHUNK, 0,
+		  end - size % MEMVFS_CHUNK);
+	}
+    }
+  f->size = size;
+  pthread_rwlock_unlock (&f->rwlock);
+  return SQLITE_OK;
+}
+
+static int
+memvfs_sync (sqlite3_file *p, int flags)
+{
+  return SQLITE_OK;
+}
+
+static int
+memvfs_file_size (sqlite3_file *p, sqlite3_int64 *size)
+{
+  struct memvfs_file *f = Memvfs_file (p);
+  pthread_rwlock_rdlock (&f->rwlock);
+  *size = f->size;
+  pthread_rwlock_unlock (&f->rwlock);
+  return SQLITE_OK;
+}
+
+static int
+memvfs_lock (sqlite3_file *p, int level)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = h->f;
+  int status = SQLITE_OK;
+
+  if (h->lock >= level)
+    return SQLITE_OK;
+  pthread_mutex_lock (&memvfs_mutex);
+  switch (level)
+    {
+    case SQLITE_LOCK_SHARED:
+      if (f->pending != NULL || f->exclusive != NULL)
+	status = SQLITE_BUSY;
+      else
+	{
+	  f->shared++;
+	  h->lock = SQLITE_LOCK_SHARED;
+	}
+      break;
+    case SQLITE_LOCK_RESERVED:
+      if (f->reserved != NULL)
+	status = SQLITE_BUSY;
+      else
+	{
+	  f->reserved = h;
+	  h->lock = SQLITE_LOCK_RESERVED;
+	}
+      break;
+    case SQLITE_LOCK_EXCLUSIVE:
+      if (f->pending != NULL && f->pending != h)
+	status = SQLITE_BUSY;
+      else
+	{
+	  /* new readers are kept out while the current ones finish */
+	  f->pending = h;
+	  if (f->shared > 1)
+	    {
+	      h->lock = SQLITE_LOCK_PENDING;
+	      status = SQLITE_BUSY;
+	    }
+	  else
+	    {
+	      f->exclusive = h;
+	      h->lock = SQLITE_LOCK_EXCLUSIVE;
+	    }
+	}
+      break;
+    }
+  pthread_mutex_unlock (&memvfs_mutex);
+  return status;
+}
+
+static int
+memvfs_unlock (sqlite3_file *p, int level)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = h->f;
+
+  if (h->lock <= level)
+    return SQLITE_OK;
+  pthread_mutex_lock (&memvfs_mutex);
+  if (f->reserved == h)
+    f->reserved = NULL;
+  if (f->pending == h)
+    f->pending = NULL;
+  if (f->exclusive == h)
+    f->exclusive = NULL;
+  if (level == SQLITE_LOCK_NONE)
+    f->shared--;
+  h->lock = level;
+  pthread_mutex_unlock (&memvfs_mutex);
+  return SQLITE_OK;
+}
+
+static int
+memvfs_check_reserved_lock (sqlite3_file *p, int *res)
+{
+  struct memvfs_file *f = Memvfs_file (p);
+  pthread_mutex_lock (&memvfs_mutex);
+  *res = f->reserved != NULL || f->pending != NULL || f->exclusive != NULL;
+  pthread_mutex_unlock (&memvfs_mutex);
+  return SQLITE_OK;
+}
+
+static int
+memvfs_file_control (sqlite3_file *p, int op, void *arg)
+{
+  return SQLITE_NOTFOUND;
+}
+
+static int
+memvfs_sector_size (sqlite3_file *p)
+{
+  return 4096;
+}
+
+static int
+memvfs_device_characteristics (sqlite3_file *p)
+{
+  return SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_SEQUENTIAL
+#ifdef SQLITE_IOCAP_POWERSAFE_OVERWRITE
+    | SQLITE_IOCAP_POWERSAFE_OVERWRITE
+#endif
+    ;
+}
+
+static int
+memvfs_shm_map (sqlite3_file *p, int region, int size, int extend,
+		void volatile **pp)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = h->f;
+  int status = SQLITE_OK;
+
+  pthread_mutex_lock (&memvfs_mutex);
+  if (! h->shm_mapped)
+    {
+      h->shm_mapped = TRUE;
+      f->shm_refs++;
+    }
+  if (region >= f->nregions && extend)
+    {
+      char **regions = sqlite3_realloc (f->regions, (region + 1) * sizeof *regions);
+      if (regions == NULL)
+	status = SQLITE_IOERR_NOMEM;
+      else
+	{
+	  f->regions = regions;
+	  f->region_size = size;
+	  while (f->nregions <= region)
+	    {
+	      char *r = memvfs_map (size);
+	      if (r == NULL)
+		{
+		  status = SQLITE_IOERR_NOMEM;
+		  break;
+		}
+	      f->regions[f->nregions++] = r;
+	    }
+	}
+    }
+  *pp = region < f->nregions ? f->regions[region] : NULL;
+  pthread_mutex_unlock (&memvfs_mutex);
+  return status;
+}
+
+static int
+memvfs_shm_lock (sqlite3_file *p, int ofst, int n, int flags)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = h->f;
+  unsigned int mask = ((1u << n) - 1) << ofst;
+  int i, status = SQLITE_OK;
+
+  pthread_mutex_lock (&memvfs_mutex);
+  if (flags & SQLITE_SHM_UNLOCK)
+    {
+      for (i=ofst; i<ofst+n; i++)
+	{
+	  if (h->shm_shared & (1u << i))
+	    f->shm_shared[i]--;
+	  if (h->shm_excl & (1u << i))
+	    f->shm_excl[i] = FALSE;
+	}
+      h->shm_shared &= ~mask;
+      h->shm_excl &= ~mask;
+    }
+  else if (flags & SQLITE_SHM_SHARED)
+    {
+      /* n is always 1 for shared locks */
+      if ((h->shm_shared | h->shm_excl) & mask)
+	;
+      else if (f->shm_excl[ofst])
+	status = SQLITE_BUSY;
+      else
+	{
+	  f->shm_shared[ofst]++;
+	  h->shm_shared |= mask;
+	}
+    }
+  else
+    {
+      for (i=ofst; i<ofst+n; i++)
+	{
+	  int own = (h->shm_shared & (1u << i)) != 0;
+	  if ((f->shm_excl[i] && ! (h->shm_excl & (1u << i)))
+	      || f->shm_shared[i] > own)
+	    status = SQLITE_BUSY;
+	}
+      if (status == SQLITE_OK)
+	{
+	  for (i=ofst; i<ofst+n; i++)
+	    f->shm_excl[i] = TRUE;
+	  h->shm_excl |= mask;
+	}
+    }
+  pthread_mutex_unlock (&memvfs_mutex);
+  return status;
+}
+
+static void
+memvfs_shm_barrier (sqlite3_file *p)
+{
+  pthread_mutex_lock (&memvfs_mutex);
+  pthread_mutex_unlock (&memvfs_mutex);
+}
+
+static int
+memvfs_shm_unmap (sqlite3_file *p, int delete_flag)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = h->f;
+
+  if (! h->shm_mapped)
+    return SQLITE_OK;
+  memvfs_shm_lock (p, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK);
+  pthread_mutex_lock (&memvfs_mutex);
+  h->shm_mapped = FALSE;
+  f->shm_refs--;
+  /* the WAL index is rebuilt from the WAL by the next connection */
+  if (f->shm_refs == 0)
+    memvfs_free_shm (f);
+  pthread_mutex_unlock (&memvfs_mutex);
+  return SQLITE_OK;
+}
+
+static const sqlite3_io_methods memvfs_io_methods = {
+  2,
+  memvfs_close,
+  memvfs_read,
+  memvfs_write,
+  memvfs_truncate,
+  memvfs_sync,
+  memvfs_file_size,
+  memvfs_lock,
+  memvfs_unlock,
+  memvfs_check_reserved_lock,
+  memvfs_file_control,
+  memvfs_sector_size,
+  memvfs_device_characteristics,
+  memvfs_shm_map,
+  memvfs_shm_lock,
+  memvfs_shm_barrier,
+  memvfs_shm_unmap
+};
+
+
+/* VFS methods; what isn't about files is forwarded to the default VFS */
+
+#define Base_vfs(v)	((sqlite3_vfs *) (v)->pAppData)
+
+static int
+memvfs_open (sqlite3_vfs *vfs, const char *name, sqlite3_file *p,
+	     int flags, int *out_flags)
+{
+  struct memvfs_handle *h = (struct memvfs_handle *) p;
+  struct memvfs_file *f = NULL;
+
+  memset (h, 0, sizeof *h);
+  pthread_mutex_lock (&memvfs_mutex);
+  if (name != NULL)
+    f = memvfs_find (name);
+  if (f == NULL)
+    {
+      if (name != NULL && ! (flags & SQLITE_OPEN_CREATE))
+	{
+	  pthread_mutex_unlock (&memvfs_mutex);
+	  return SQLITE_CANTOPEN;
+	}
+      f = sqlite3_malloc (sizeof *f);
+      if (f != NULL)
+	{
+	  memset (f, 0, sizeof *f);
+	  if (name != NULL && (f->name = sqlite3_mprintf ("%s", name)) == NULL)
+	    {
+	      sqlite3_free (f);
+	      f = NULL;
+	    }
+	}
+      if (f == NULL)
+	{
+	  pthread_mutex_unlock (&memvfs_mutex);
+	  return SQLITE_NOMEM;
+	}
+      pthread_rwlock_init (&f->rwlock, NULL);
+      if (f->name != NULL)
+	{
+	  f->next = memvfs_files;
+	  memvfs_files = f;
+	}
+    }
+  f->refs++;
+  pthread_mutex_unlock (&memvfs_mutex);
+
+  h->base.pMethods = &memvfs_io_methods;
+  h->f = f;
+  h->delete_on_close = (flags & SQLITE_OPEN_DELETEONCLOSE) != 0;
+  if (out_flags != NULL)
+    *out_flags = flags;
+  return SQLITE_OK;
+}
+
+static int
+memvfs_delete (sqlite3_vfs *vfs, const char *name, int sync_dir)
+{
+  struct memvfs_file *f;
+  pthread_mutex_lock (&memvfs_mutex);
+  f = memvfs_find (name);
+  if (f != NULL)
+    {
+      memvfs_unlink (f);
+      sqlite3_free (f->name);
+      f->name = NULL;
+      if (f->refs == 0)
+	memvfs_free (f);
+    }
+  pthread_mutex_unlock (&memvfs_mutex);
+#ifdef SQLITE_IOERR_DELETE_NOENT
+  return f != NULL ? SQLITE_OK : SQLITE_IOERR_DELETE_NOENT;
+#else
+  return f != NULL ? SQLITE_OK : SQLITE_IOERR_DELETE;
+#endif
+}
+
+static int
+memvfs_access (sqlite3_vfs *vfs, const char *name, int flags, int *res)
+{
+  pthread_mutex_lock (&memvfs_mutex);
+  *res = memvfs_find (name) != NULL;
+  pthread_mutex_unlock (&memvfs_mutex);
+  return SQLITE_OK;
+}
+
+static int
+memvfs_full_pathname (sqlite3_vfs *vfs, const char *name, int n, char *out)
+{
+  sqlite3_snprintf (n, out, "%s", name);
+  return SQLITE_OK;
+}
+
+static void *
+memvfs_dlopen (sqlite3_vfs *vfs, const char *path)
+{
+  return Base_vfs (vfs)->xDlOpen (Base_vfs (vfs), path);
+}
+
+static void
+memvfs_dlerror (sqlite3_vfs *vfs, int n, char *msg)
+{
+  Base_vfs (vfs)->xDlError (Base_vfs (vfs), n, msg);
+}
+
+static void
+(*memvfs_dlsym (sqlite3_vfs *vfs, void *handle, const char *sym)) (void)
+{
+  return Base_vfs (vfs)->xDlSym (Base_vfs (vfs), handle, sym);
+}
+
+static void
+memvfs_dlclose (sqlite3_vfs *vfs, void *handle)
+{
+  Base_vfs (vfs)->xDlClose (Base_vfs (vfs), handle);
+}
+
+static int
+memvfs_randomness (sqlite3_vfs *vfs, int n, char *out)
+{
+  return Base_vfs (vfs)->xRandomness (Base_vfs (vfs), n, out);
+}
+
+static int
+memvfs_sleep (sqlite3_vfs *vfs, int us)
+{
+  return Base_vfs (vfs)->xSleep (Base_vfs (vfs), us);
+}
+
+static int
+memvfs_current_time (sqlite3_vfs *vfs, double *t)
+{
+  return Base_vfs (vfs)->xCurrentTime (Base_vfs (vfs), t);
+}
+
+static int
+memvfs_get_last_error (sqlite3_vfs *vfs, int n, char *msg)
+{
+  return Base_vfs (vfs)->xGetLastError (Base_vfs (vfs), n, msg);
+}
+
+static int
+memvfs_current_time_int64 (sqlite3_vfs *vfs, sqlite3_int64 *t)
+{
+  sqlite3_vfs *base = Base_vfs (vfs);
+  double d;
+  int status;
+  if (base->iVersion >= 2 && base->xCurrentTimeInt64 != NULL)
+    return base->xCurrentTimeInt64 (base, t);
+  status = base->xCurrentTime (base, &d);
+  *t = (sqlite3_int64) (d * 86400000.0);
+  return status;
+}
+
+#endif /* HAVE_PTHREAD */
+
+CAMLprim value
+ml_sqlite3_memvfs_register (value name, value make_default)
+{
+#ifdef HAVE_PTHREAD
+  sqlite3_vfs *base, *vfs;
+  int status;
+
+  if (sqlite3_vfs_find (String_val (name)) != NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "VFS already registered", TRUE);
+  base = sqlite3_vfs_find (NULL);
+  if (base == NULL)
+    ml_sqlite3_raise_exn (SQLITE_ERROR, "no default VFS", TRUE);
+  vfs = sqlite3_malloc (sizeof *vfs);
+  if (vfs == NULL)
+    caml_raise_out_of_memory ();
+  memset (vfs, 0, sizeof *vfs);
+  vfs->iVersion          = 2;
+  vfs->szOsFile          = sizeof (struct memvfs_handle);
+  vfs->mxPathname        = base->mxPathname;
+  vfs->zName             = sqlite3_mprintf ("%s", String_val (name));
+  if (vfs->zName == NULL)
+    {
+      sqlite3_free (vfs);
+      caml_raise_out_of_memory ();
+    }
+  vfs->pAppData          = base;
+  vfs->xOpen             = memvfs_open;
+  vfs->xDelete           = memvfs_delete;
+  vfs->xAccess           = memvfs_access;
+  vfs->xFullPathname     = memvfs_full_pathname;
+  vfs->xDlOpen           = memvfs_dlopen;
+  vfs->xDlError          = memvfs_dlerror;
+  vfs->xDlSym            = memvfs_dlsym;
+  vfs->xDlClose          = memvfs_dlclose;
+  vfs->xRandomness       = memvfs_randomness;
+  vfs->xSleep            = memvfs_sleep;
+  vfs->xCurrentTime      = memvfs_current_time;
+  vfs->xGetLastError     = memvfs_get_last_error;
+  vfs->xCurrentTimeInt64 = memvfs_current_time_int64;
+
+  status = sqlite3_vfs_register (vfs, Bool_val (make_default));
+  if (status != SQLITE_OK)
+    {
+      sqlite3_free ((char *) vfs->zName);
+      sqlite3_free (vfs);
+      ml_sqlite3_raise_exn (status, "cannot register VFS", TRUE);
+    }
+  return Val_unit;
+#else
+  caml_failwith ("Sqlite3.memvfs_register: threads unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_memvfs_delete (value vfs_name, value name)
+{
+#ifdef HAVE_PTHREAD
+  sqlite3_vfs *vfs = sqlite3_vfs_find (String_val (vfs_name));
+  if (vfs == NULL || vfs->xOpen != memvfs_open)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "not a memory VFS", TRUE);
+  memvfs_delete (vfs, String_val (name), FALSE);
+#endif
+  return Val_unit;
+}
@@ -1,5 +1,7 @@
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/time.h>
 
 #define CAML_NAME_SPACE
 
@@ -8,25 +10,23 @@
 #include <caml/fail.h>
 #include <caml/callback.h>
 #include <caml/custom.h>
+#include <caml/signals.h>
 
 #include <sqlite3.h>
 
 #include "ocaml-sqlite3.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 /* Not wrapped :
    - user-defined aggregate functions
-   - collation functions
    - sqlite3_db_handle -> should not be wrapped !
-   - sqlite3_commit_hook
    - sqlite3_global_recover
    - sqlite3_set_authorizer
 */
 
-/* compatibility for OCaml < 3.10 */
-#ifndef CAMLreturnT
-# define CAMLreturnT(t,e) CAMLreturn(e)
-#endif
-
 
 
 /* Error handling */
@@ -75,18 +75,52 @@ ml_sqlite3_global_root_destroy (void *data)
   caml_stat_free (data);
 }
 
+/* monotonic clock, in ns */
+sqlite3_int64
+ml_sqlite3_now (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return (sqlite3_int64) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/* the same clock for OCaml, in s */
+CAMLprim value
+ml_sqlite3_monotonic (value unit)
+{
+  return caml_copy_double (ml_sqlite3_now () * 1e-9);
+}
+
 
 
 /* 0 -> busy
  * 1 -> trace
  * 2 -> progress
+ * 3 -> exception raised by a collation, pending
  */
-#define NUM_CALLBACKS 3
+#define NUM_CALLBACKS 4
+
+static void ml_sqlite3_feed_destroy (struct ml_sqlite3_data *);
+static void ml_sqlite3_watch_detach (struct ml_sqlite3_data *);
+static void ml_sqlite3_qlog_destroy (struct ml_sqlite3_data *);
+static void ml_sqlite3_qlog_displaced (struct ml_sqlite3_data *);
 
 static void 
 ml_finalize_sqlite3 (value v)
 {
   struct ml_sqlite3_data *data = Sqlite3_data_val(v);
+  ml_sqlite3_feed_destroy (data);
+  ml_sqlite3_watch_detach (data);
+  ml_sqlite3_qlog_destroy (data);
+  if (data->db != NULL)
+    sqlite3_busy_handler (data->db, NULL, NULL);
+  caml_stat_free (data->busy);
   caml_remove_global_root (&data->callbacks);
   caml_remove_global_root (&data->stmt_store);
   caml_stat_free (data);
@@ -132,6 +166,10 @@ ml_wrap_sqlite3 (sqlite3 *db)
   data->db = db;
   data->callbacks = caml_alloc (NUM_CALLBACKS, 0);
   data->stmt_store = Val_unit;
+  data->feed = NULL;
+  data->watch = NULL;
+  data->busy = NULL;
+  data->qlog = NULL;
   caml_register_global_root (&data->callbacks);
   caml_register_global_root (&data->stmt_store);
   CAMLreturn(v);
@@ -155,6 +193,25 @@ ml_sqlite3_open (value filename)
   return ml_wrap_sqlite3 (db);
 }
 
+CAMLprim value
+ml_sqlite3_open_vfs (value vfs, value filename)
+{
+  sqlite3 *db;
+  int status;
+
+  status = sqlite3_open_v2 (String_val(filename), &db,
+			    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			    String_val(vfs));
+  if (status != SQLITE_OK)
+    {
+      char *errmsg = sqlite3_mprintf ("%s", db ? sqlite3_errmsg (db) : "out of memory");
+      sqlite3_close (db);
+      ml_sqlite3_raise_exn (status, errmsg, FALSE);
+    }
+
+  return ml_wrap_sqlite3 (db);
+}
+
 CAMLprim value
 ml_sqlite3_close (value db)
 {
@@ -166,6 +223,7 @@ ml_sqlite3_close (value db)
       if (status != SQLITE_OK)
 	raise_sqlite3_exn (db);
       data->db = NULL;
+      ml_sqlite3_watch_detach (data);
     }
   return Val_unit;
 }
@@ -317,6 +375,87 @@ ml_sqlite3_busy_timeout (value db, value t)
   return Val_unit;
 }
 
+/* Busy handler with exponential backoff, in C. The n-th retry of a
+   busy episode sleeps a random time between half and all of
+   min (cap, base * 2^n), without going past the timeout. */
+
+struct ml_sqlite3_busy {
+  int base;			/* in us */
+  int cap;			/* in us */
+  sqlite3_int64 timeout;	/* in us */
+  sqlite3_int64 start;		/* beginning of the current episode */
+  unsigned int seed;
+  long retries;
+  long failures;
+  sqlite3_int64 waited;		/* in us */
+};
+
+static int
+ml_sqlite3_busy_backoff_cb (void *data, int num)
+{
+  struct ml_sqlite3_busy *b = data;
+  sqlite3_int64 now, left, delay;
+
+  now = ml_sqlite3_now () / 1000;
+  if (num == 0)
+    b->start = now;
+  left = b->start + b->timeout - now;
+  if (left <= 0)
+    {
+      b->failures++;
+      return 0;
+    }
+
+  delay = b->cap;
+  if (num < 30 && ((sqlite3_int64) b->base << num) < b->cap)
+    delay = (sqlite3_int64) b->base << num;
+  b->seed = b->seed * 1103515245 + 12345;
+  delay = delay / 2 + (b->seed >> 8) % (delay / 2 + 1);
+  if (delay > left)
+    delay = left;
+
+  sqlite3_vfs_find (NULL)->xSleep (sqlite3_vfs_find (NULL), delay);
+  b->retries++;
+  b->waited += ml_sqlite3_now () / 1000 - now;
+  return 1;
+}
+
+CAMLprim value
+ml_sqlite3_busy_backoff (value db, value base, value cap, value timeout)
+{
+  struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
+  struct ml_sqlite3_busy *b;
+  if (Long_val (base) <= 0 || Long_val (cap) < Long_val (base))
+    caml_invalid_argument ("Sqlite3.busy_backoff");
+  b = db_data->busy;
+  if (b == NULL)
+    {
+      b = caml_stat_alloc (sizeof *b);
+      db_data->busy = b;
+    }
+  memset (b, 0, sizeof *b);
+  b->base    = Long_val (base) * 1000;
+  b->cap     = Long_val (cap) * 1000;
+  b->timeout = (sqlite3_int64) Long_val (timeout) * 1000;
+  b->seed    = (unsigned int) ml_sqlite3_now () ^ (unsigned int) (intnat) b;
+  sqlite3_busy_handler (Sqlite3_val (db), ml_sqlite3_busy_backoff_cb, b);
+  Store_field (db_data->callbacks, 0, Val_unit);
+  return Val_unit;
+}
+
+CAMLprim value
+ml_sqlite3_busy_stats (value db)
+{
+  CAMLparam1(db);
+  CAMLlocal1(r);
+  struct ml_sqlite3_busy *b = Sqlite3_data_val(db)->busy;
+  r = caml_alloc_small (3, 0);
+  Field (r, 0) = Val_long (b ? b->retries : 0);
+  Field (r, 1) = Val_long (b ? b->failures : 0);
+  Field (r, 2) = Val_long (b ? b->waited / 1000 : 0);
+  CAMLreturn (r);
+}
+
 static void 
 ml_sqlite3_trace_handler (void *data, const char *req)
 {
@@ -331,6 +470,7 @@ ml_sqlite3_trace (value db, value cb)
   struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
   sqlite3_trace (Sqlite3_val (db), ml_sqlite3_trace_handler, db_data);
   Store_field (db_data->callbacks, 1, cb);
+  ml_sqlite3_qlog_displaced (db_data);
   return Val_unit;
 }
 
@@ -340,189 +480,1091 @@ ml_sqlite3_trace_unset (value db)
   struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
   sqlite3_trace (Sqlite3_val (db), NULL, NULL);
   Store_field (db_data->callbacks, 1, Val_unit);
+  ml_sqlite3_qlog_displaced (db_data);
   return Val_unit;
 }
 
-#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
-static int 
-ml_sqlite3_progress_handler_cb (void *data)
+/* Query log: a ring buffer of (timestamp, duration, sql, rows) filled
+   from the profile event of sqlite3_trace_v2. Statements are recorded
+   if they're slow or sampled (one out of n), the others only cost a
+   counter increment. Rows are counted per statement from the row
+   events in a small table keyed by the statement, probed from a hash
+   of its address. When more statements are running than the table
+   holds, the rows of the untracked ones are reported as -1 (unknown)
+   until the table empties. The query log and trace_set
+   share the trace hook of the connection: the last one set wins. */
+
+#ifdef HAVE_SQLITE3_TRACE_V2
+
+#define QLOG_SQL_SIZE	240
+#define QLOG_ROW_SLOTS	16
+
+struct ml_sqlite3_qlog_entry {
+  double time;
+  sqlite3_int64 duration;	/* in ns */
+  int rows;
+  char sql[QLOG_SQL_SIZE];
+};
+
+struct ml_sqlite3_qlog {
+  struct ml_sqlite3_qlog_entry *ring;
+  unsigned int size;
+  unsigned int head;
+  unsigned int count;
+  unsigned int sample;		/* 0: no sampling */
+  unsigned int counter;
+  sqlite3_int64 slow;		/* in ns, < 0: disabled */
+  int installed;		/* not replaced by trace_set */
+  int used;			/* slots of rows in use */
+  int untracked;		/* rows not counted since the table was full */
+  struct {
+    sqlite3_stmt *stmt;
+    int rows;
+  } rows[QLOG_ROW_SLOTS];
+};
+
+#define Qlog_slot(s)	((((uintnat) (s)) >> 4) % QLOG_ROW_SLOTS)
+
+/* The slot of stmt, or a new one if create, or -1. No slot is
+   created while rows are untracked: a statement that lost rows must
+   not get a partial count. */
+static int
+ml_sqlite3_qlog_slot (struct ml_sqlite3_qlog *q, sqlite3_stmt *stmt, int create)
 {
- struct ml_sqlite3_data *db = data;
- value res;
- res = caml_callback_exn (Field (db->callbacks, 2), Val_unit);
- return Is_exception_result(res);
+  int i, slot, free_slot = -1;
+  for (i=0; i<QLOG_ROW_SLOTS; i++)
+    {
+      slot = (Qlog_slot (stmt) + i) % QLOG_ROW_SLOTS;
+      if (q->rows[slot].stmt == stmt)
+	return slot;
+      if (q->rows[slot].stmt == NULL && free_slot < 0)
+	free_slot = slot;
+    }
+  if (! create || free_slot < 0 || q->untracked)
+    return -1;
+  q->rows[free_slot].stmt = stmt;
+  q->rows[free_slot].rows = 0;
+  q->used++;
+  return free_slot;
+}
+
+static int
+ml_sqlite3_qlog_cb (unsigned int event, void *data, void *p, void *x)
+{
+  struct ml_sqlite3_qlog *q = data;
+  sqlite3_stmt *stmt = p;
+  sqlite3_int64 duration;
+  int slot, rows = 0;
+
+  if (event == SQLITE_TRACE_ROW)
+    {
+      slot = ml_sqlite3_qlog_slot (q, stmt, TRUE);
+      if (slot >= 0)
+	q->rows[slot].rows++;
+      else
+	q->untracked = TRUE;
+      return 0;
+    }
+
+  /* SQLITE_TRACE_PROFILE */
+  slot = ml_sqlite3_qlog_slot (q, stmt, FALSE);
+  if (slot >= 0)
+    {
+      rows = q->rows[slot].rows;
+      q->rows[slot].stmt = NULL;
+      q->used--;
+    }
+  else if (q->untracked)
+    rows = -1;
+  if (q->used == 0)
+    q->untracked = FALSE;
+  duration = * (sqlite3_int64 *) x;
+  q->counter++;
+  if ((q->slow >= 0 && duration >= q->slow)
+      || (q->sample > 0 && q->counter >= q->sample))
+    {
+      struct ml_sqlite3_qlog_entry *e;
+      struct timeval tv;
+      const char *sql;
+      if (q->counter >= q->sample)
+	q->counter = 0;
+      if (q->count == q->size)
+	{
+	  q->head = (q->head + 1) % q->size;
+	  q->count--;
+	}
+      e = &q->ring[(q->head + q->count) % q->size];
+      q->count++;
+      gettimeofday (&tv, NULL);
+      e->time = tv.tv_sec + tv.tv_usec * 1e-6;
+      e->duration = duration;
+      e->rows = rows;
+      sql = sqlite3_sql (stmt);
+      strncpy (e->sql, sql ? sql : "", QLOG_SQL_SIZE - 1);
+      e->sql[QLOG_SQL_SIZE - 1] = '\0';
+    }
+  return 0;
 }
 #endif
 
-CAMLprim value 
-ml_sqlite3_progress_handler (value db, value delay, value cb)
+static void
+ml_sqlite3_qlog_destroy (struct ml_sqlite3_data *data)
+{
+#ifdef HAVE_SQLITE3_TRACE_V2
+  if (data->qlog == NULL)
+    return;
+  if (data->db != NULL && data->qlog->installed)
+    sqlite3_trace_v2 (data->db, 0, NULL, NULL);
+  caml_stat_free (data->qlog->ring);
+  caml_stat_free (data->qlog);
+  data->qlog = NULL;
+#endif
+}
+
+static void
+ml_sqlite3_qlog_displaced (struct ml_sqlite3_data *data)
 {
-#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
-  struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
-  sqlite3_progress_handler (Sqlite3_val (db), Int_val (delay), 
-			    ml_sqlite3_progress_handler_cb, db_data);
-  Store_field (db_data->callbacks, 2, cb);
+#ifdef HAVE_SQLITE3_TRACE_V2
+  if (data->qlog != NULL)
+    data->qlog->installed = FALSE;
 #endif
-  return Val_unit;
 }
 
-CAMLprim value 
-ml_sqlite3_progress_handler_unset (value db)
+CAMLprim value
+ml_sqlite3_query_log_enable (value db, value sample, value slow, value size)
 {
-#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+#ifdef HAVE_SQLITE3_TRACE_V2
   struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
-  sqlite3_progress_handler (Sqlite3_val(db), 0, NULL, NULL);
-  Store_field (db_data->callbacks, 2, Val_unit);
+  sqlite3 *s_db = Sqlite3_val (db);
+  struct ml_sqlite3_qlog *q;
+
+  if (Long_val (size) <= 0 || Long_val (sample) < 0)
+    caml_invalid_argument ("Sqlite3.query_log_enable");
+  ml_sqlite3_qlog_destroy (db_data);
+  q = caml_stat_alloc (sizeof *q);
+  memset (q, 0, sizeof *q);
+  q->ring = caml_stat_alloc (Long_val (size) * sizeof (struct ml_sqlite3_qlog_entry));
+  q->size = Long_val (size);
+  q->sample = Long_val (sample);
+  q->slow = Long_val (slow) < 0 ? -1 : (sqlite3_int64) Long_val (slow) * 1000000;
+  q->installed = TRUE;
+  db_data->qlog = q;
+  sqlite3_trace_v2 (s_db, SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW,
+		    ml_sqlite3_qlog_cb, q);
+  Store_field (db_data->callbacks, 1, Val_unit);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_trace_v2 unavailable");
 #endif
+}
+
+CAMLprim value
+ml_sqlite3_query_log_disable (value db)
+{
+  ml_sqlite3_qlog_destroy (Sqlite3_data_val(db));
   return Val_unit;
 }
 
+CAMLprim value
+ml_sqlite3_query_log_drain (value db)
+{
+#ifdef HAVE_SQLITE3_TRACE_V2
+  CAMLparam1(db);
+  CAMLlocal4(r, e, t, s);
+  struct ml_sqlite3_qlog *q = Sqlite3_data_val(db)->qlog;
+  unsigned int i;
 
-
-#define MLTAG_INTEGER  769598269L
-#define MLTAG_FLOAT     17431289L
-#define MLTAG_TEXT    1869949275L
-#define MLTAG_BLOB    1471417019L
-#define MLTAG_NULL    1738460431L
+  if (q == NULL || q->count == 0)
+    CAMLreturn (Atom (0));
+  r = caml_alloc (q->count, 0);
+  for (i=0; i<q->count; i++)
+    {
+      struct ml_sqlite3_qlog_entry *en = &q->ring[(q->head + i) % q->size];
+      t = caml_copy_double (en->time);
+      s = caml_copy_string (en->sql);
+      e = caml_alloc (4, 0);
+      Store_field (e, 0, t);
+      t = caml_copy_double (en->duration * 1e-9);
+      Store_field (e, 1, t);
+      Store_field (e, 2, s);
+      Store_field (e, 3, Val_int (en->rows));
+      Store_field (r, i, e);
+    }
+  q->head = 0;
+  q->count = 0;
+  CAMLreturn (r);
+#else
+  return Atom (0);
+#endif
+}
 
-#define MLTAG_INT        7295391L
-#define MLTAG_INT64   2015220635L
-#define MLTAG_VALUE   1598910115L
+/* The progress handler of a connection is shared by the OCaml progress
+   callback, the deadline and the cancel tokens. The deadline and the
+   cancel flag are checked in C, the OCaml callback is only invoked if
+   one was set with progress_handler_set. The statements of the
+   connection keep a reference to its watch, through which step finds
+   the deadline and the cancel flag. The time limit set by deadline_set
+   applies to each statement: the deadline is computed again when a
+   statement starts. */
 
-static value
-convert_sqlite3_type (int t)
-{
-  switch (t)
+struct ml_sqlite3_watch {
+  sqlite3 *db;
+  struct ml_sqlite3_data *data;
+  sqlite3_int64 timeout;	/* time limit of a statement, in ns; 0 if none */
+  sqlite3_int64 deadline;	/* monotonic clock, in ns; 0 if none */
+  volatile int cancelled;
+  volatile int timed_out;
+  int ocaml_progress;
+  int ocaml_period;
+  int ocaml_funcs;		/* functions, collations and tokenizers */
+  int period;
+  int tokens;			/* live cancel tokens */
+  int stale;			/* the handler must be installed again */
+  int refs;			/* the connection, its statements and tokens */
+};
+
+static struct ml_sqlite3_watch *
+ml_sqlite3_watch_get (value db)
+{
+  sqlite3 *s_db = Sqlite3_val (db);
+  struct ml_sqlite3_data *data = Sqlite3_data_val(db);
+  struct ml_sqlite3_watch *w = data->watch;
+  if (w == NULL)
     {
-    case SQLITE_INTEGER:
-      return MLTAG_INTEGER;
-    case SQLITE_FLOAT:
-      return MLTAG_FLOAT;
-    case SQLITE_TEXT:
-      return MLTAG_TEXT;
-    case SQLITE_BLOB:
-      return MLTAG_BLOB;
-    default:
-      return MLTAG_NULL;
+      w = caml_stat_alloc (sizeof *w);
+      memset (w, 0, sizeof *w);
+      w->db   = s_db;
+      w->data = data;
+      w->refs = 1;
+      data->watch = w;
     }
+  return w;
 }
 
+struct ml_sqlite3_watch *
+ml_sqlite3_watch_ref (value db)
+{
+  struct ml_sqlite3_watch *w = ml_sqlite3_watch_get (db);
+  w->refs++;
+  return w;
+}
 
+void
+ml_sqlite3_watch_release (struct ml_sqlite3_watch *w)
+{
+  w->refs--;
+  if (w->refs == 0)
+    caml_stat_free (w);
+}
 
-
-/* Prepared statements */
+/* called when the connection is closed or finalized */
+static void
+ml_sqlite3_watch_detach (struct ml_sqlite3_data *data)
+{
+  struct ml_sqlite3_watch *w = data->watch;
+  if (w == NULL)
+    return;
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+  if (data->db != NULL)
+    sqlite3_progress_handler (data->db, 0, NULL, NULL);
+#endif
+  w->db   = NULL;
+  w->data = NULL;
+  data->watch = NULL;
+  ml_sqlite3_watch_release (w);
+}
 
-CAMLprim value
-ml_sqlite3_finalize_noerr (value s)
+/* The deadline of a statement of the connection of w starting now */
+sqlite3_int64
+ml_sqlite3_watch_deadline (struct ml_sqlite3_watch *w)
 {
-  sqlite3_stmt **p_stmt = (sqlite3_stmt **) s;
+  sqlite3_int64 deadline;
+  if (w->timeout == 0)
+    return 0;
+  deadline = ml_sqlite3_now () + w->timeout;
+  return deadline == 0 ? 1 : deadline;
+}
 
-  if (*p_stmt != NULL)
+static void ml_sqlite3_watch_install (struct ml_sqlite3_watch *);
+
+/* The statement starting on the connection of w is a new one: a
+   cancel or a timeout of the previous one does not apply to it, and
+   its time limit starts now. */
+static void
+ml_sqlite3_watch_restart (struct ml_sqlite3_watch *w)
+{
+  w->cancelled = FALSE;
+  w->timed_out = FALSE;
+  w->deadline = ml_sqlite3_watch_deadline (w);
+  if (w->stale && w->db != NULL)
+    ml_sqlite3_watch_install (w);
+}
+
+/* Whether a step on the connection of w may call OCaml code: the
+   runtime lock can only be released if it doesn't. The change feed
+   and the query log run in C but are drained from OCaml without
+   other synchronization, so they count as well. */
+static int
+ml_sqlite3_watch_runs_ocaml (struct ml_sqlite3_watch *w)
+{
+  struct ml_sqlite3_data *data = w->data;
+  return data == NULL
+    || w->ocaml_progress
+    || w->ocaml_funcs > 0
+    || Field (data->callbacks, 0) != Val_unit
+    || Field (data->callbacks, 1) != Val_unit
+    || data->feed != NULL
+    || data->qlog != NULL;
+}
+
+/* Whether the statement running under w must stop: cancelled, or past
+   its deadline. Only reads w, so it may be called without the runtime
+   lock. */
+int
+ml_sqlite3_watch_expired (struct ml_sqlite3_watch *w, sqlite3_int64 deadline,
+			  int *timed_out)
+{
+  if (w->cancelled)
+    return TRUE;
+  if (deadline != 0 && ml_sqlite3_now () >= deadline)
     {
-      sqlite3_finalize (*p_stmt);
-      *p_stmt = NULL;
+      *timed_out = TRUE;
+      return TRUE;
     }
-  return Val_unit;
+  return FALSE;
 }
 
-static sqlite3_stmt *
-ml_sqlite3_prepare_stmt (value db, value sql, value sql_off, unsigned int *tail_pos)
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+static int
+ml_sqlite3_progress_handler_cb (void *data)
 {
-  CAMLparam2(db, sql);
-  sqlite3_stmt *stmt = NULL;
-  const char *tail;
-  int status;
-  unsigned int off = Unsigned_int_val (sql_off);
-  status = sqlite3_prepare_v2 (Sqlite3_val (db), 
-                               String_val (sql) + off,
-                               caml_string_length (sql) - off + 1,
-                               &stmt, &tail);
-  if (status != SQLITE_OK)
-    raise_sqlite3_exn (db);
-  if (tail_pos != NULL)
-    *tail_pos = tail - String_val (sql);
-  CAMLreturnT (sqlite3_stmt *, stmt);
+  struct ml_sqlite3_watch *w = data;
+  int timed_out = FALSE;
+  if (ml_sqlite3_watch_expired (w, w->deadline, &timed_out))
+    {
+      if (timed_out)
+	w->timed_out = TRUE;
+      return 1;
+    }
+  if (w->ocaml_progress)
+    {
+      value res;
+      res = caml_callback_exn (Field (w->data->callbacks, 2), Val_unit);
+      return Is_exception_result(res);
+    }
+  return 0;
 }
+#endif
 
-CAMLprim value
-ml_sqlite3_prepare (value db, value sql, value sql_off)
+static void
+ml_sqlite3_watch_install (struct ml_sqlite3_watch *w)
 {
-  CAMLparam2(db, sql);
-  CAMLlocal3(t, o, s);
-  sqlite3_stmt *stmt;
-  unsigned int tail_pos;
-
-  stmt = ml_sqlite3_prepare_stmt (db, sql, sql_off, &tail_pos);
-  if (stmt == NULL)
-    o = Val_unit;
+  w->stale = FALSE;
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+  if (w->ocaml_progress)
+    sqlite3_progress_handler (w->db, w->ocaml_period,
+			      ml_sqlite3_progress_handler_cb, w);
+  else if (w->timeout != 0 || w->tokens > 0)
+    sqlite3_progress_handler (w->db, w->period,
+			      ml_sqlite3_progress_handler_cb, w);
   else
-    {
-      s = caml_alloc_small (1, Abstract_tag);
-      Field (s, 0) = Val_bp (stmt);
-      o = caml_alloc_small (1, 0);
-      Field (o, 0) = s;
-    }
-  t = caml_alloc_small (2, 0);
-  Field (t, 0) = o;
-  Field (t, 1) = Val_int (tail_pos);
-  CAMLreturn (t);
+    sqlite3_progress_handler (w->db, 0, NULL, NULL);
+#endif
 }
 
 CAMLprim value
-ml_sqlite3_reset (value stmt)
+ml_sqlite3_progress_handler (value db, value delay, value cb)
 {
-  sqlite3_stmt *s = Sqlite3_stmt_val (stmt);
-  sqlite3_reset (s);
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+  struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
+  struct ml_sqlite3_watch *w = ml_sqlite3_watch_get (db);
+  Store_field (db_data->callbacks, 2, cb);
+  w->ocaml_progress = TRUE;
+  w->ocaml_period = Int_val (delay);
+  ml_sqlite3_watch_install (w);
+#endif
   return Val_unit;
 }
 
 CAMLprim value
-ml_sqlite3_expired (value stmt)
+ml_sqlite3_progress_handler_unset (value db)
 {
-  sqlite3_stmt *s = * ((sqlite3_stmt **) stmt);
-  return Val_bool (s == NULL);
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+  struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
+  struct ml_sqlite3_watch *w = ml_sqlite3_watch_get (db);
+  w->ocaml_progress = FALSE;
+  ml_sqlite3_watch_install (w);
+  Store_field (db_data->callbacks, 2, Val_unit);
+#endif
+  return Val_unit;
 }
 
-#define MLTAG_ROW	   8190965L
-#define MLTAG_DONE	1516073221L
-
 CAMLprim value
-ml_sqlite3_step (value stmt)
+ml_sqlite3_deadline_set (value db, value period, value ms)
 {
-  CAMLparam1(stmt);
-  CAMLlocal1(r);
-  int status;
-  sqlite3_stmt *s = Sqlite3_stmt_val (stmt);
+#ifdef HAVE_SQLITE3_PROGRESS_HANDLER
+  struct ml_sqlite3_watch *w;
+  if (Int_val (period) <= 0)
+    caml_invalid_argument ("Sqlite3.deadline_set");
+  w = ml_sqlite3_watch_get (db);
+  w->timeout = (sqlite3_int64) Long_val (ms) * 1000000;
+  if (w->timeout <= 0)
+    w->timeout = 1;
+  /* for a statement already running, or if step can't tell when a
+     statement starts */
+  w->deadline = ml_sqlite3_watch_deadline (w);
+  w->period = Int_val (period);
+  w->timed_out = FALSE;
+  w->cancelled = FALSE;
+  ml_sqlite3_watch_install (w);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_progress_handler unavailable");
+#endif
+}
 
-  status = sqlite3_step (s);
-  switch (status)
-    {
-    case SQLITE_ROW:
-      r = MLTAG_ROW; break;
-    case SQLITE_DONE:
-      r = MLTAG_DONE; break;
-    default:
-      {
-	sqlite3 *db;
-	db = sqlite3_db_handle (s);
-	ml_sqlite3_raise_exn (status, sqlite3_errmsg (db), TRUE);
-      }
-    }
-  CAMLreturn (r);
+CAMLprim value
+ml_sqlite3_deadline_clear (value db)
+{
+  struct ml_sqlite3_watch *w = ml_sqlite3_watch_get (db);
+  w->timeout = 0;
+  w->deadline = 0;
+  w->timed_out = FALSE;
+  w->cancelled = FALSE;
+  ml_sqlite3_watch_install (w);
+  return Val_unit;
 }
 
+#define Watch_val(v)	(* ((struct ml_sqlite3_watch **) Data_custom_val(v)))
 
-
-/* sqlite3_bind_* */
+/* Runs in the GC, maybe while another thread steps on the connection:
+   the handler is left in place until the next statement starts. */
+static void
+ml_finalize_cancel_token (value v)
+{
+  struct ml_sqlite3_watch *w = Watch_val (v);
+  w->tokens--;
+  w->stale = TRUE;
+  ml_sqlite3_watch_release (w);
+}
 
 CAMLprim value
-ml_sqlite3_bind (value s, value idx, value v)
+ml_sqlite3_cancel_token (value db)
 {
-  sqlite3_stmt *stmt = Sqlite3_stmt_val (s);
-  int i = Int_val (idx);
-  int status;
+  static struct custom_operations ops = {
+    "mlsqlite3/cancel/001",
+    ml_finalize_cancel_token,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+#ifdef custom_compare_ext_default
+    custom_compare_ext_default
+#endif
+  };
+  struct ml_sqlite3_watch *w = ml_sqlite3_watch_get (db);
+  value v;
+  if (w->period <= 0)
+    w->period = 1000;
+  v = caml_alloc_custom (&ops, sizeof w, 0, 1);
+  Watch_val (v) = w;
+  w->refs++;
+  w->tokens++;
+  ml_sqlite3_watch_install (w);
+  return v;
+}
 
-  if (Is_long (v))
+CAMLprim value
+ml_sqlite3_cancel (value t)
+{
+  struct ml_sqlite3_watch *w = Watch_val (t);
+  w->cancelled = TRUE;
+  if (w->db != NULL)
+    sqlite3_interrupt (w->db);
+  return Val_unit;
+}
+
+
+
+/* Change feed: the update hook records (op, table, rowid) in a ring
+   buffer, the commit hook publishes the records of the transaction as
+   one batch and the rollback hook discards them. No OCaml code runs in
+   the hooks, batches are retrieved later with change_feed_drain. */
+
+struct ml_sqlite3_change {
+  sqlite3_int64 rowid;
+  int table;
+  unsigned char op;
+  unsigned char first;	/* first record of a transaction */
+};
+
+struct ml_sqlite3_feed {
+  struct ml_sqlite3_change *ring;
+  unsigned int size;
+  unsigned int head;	/* oldest published record */
+  unsigned int count;	/* number of published records */
+  unsigned int pending;	/* records of the current transaction */
+  int truncated;	/* the current transaction did not fit */
+  long lost;		/* number of dropped transactions */
+  char **tables;
+  int n_tables;
+  int last_table;
+};
+
+static int
+ml_sqlite3_feed_table (struct ml_sqlite3_feed *f, const char *name)
+{
+  int i;
+  char *s;
+  if (f->last_table >= 0 && strcmp (f->tables[f->last_table], name) == 0)
+    return f->last_table;
+  for (i=0; i<f->n_tables; i++)
+    if (strcmp (f->tables[i], name) == 0)
+      return f->last_table = i;
+  if ((f->n_tables & (f->n_tables - 1)) == 0)
+    {
+      char **t;
+      t = sqlite3_realloc (f->tables,
+			   (f->n_tables ? 2 * f->n_tables : 1) * sizeof (char *));
+      if (t == NULL)
+	return -1;
+      f->tables = t;
+    }
+  s = sqlite3_mprintf ("%s", name);
+  if (s == NULL)
+    return -1;
+  f->tables[f->n_tables] = s;
+  return f->last_table = f->n_tables++;
+}
+
+static void
+ml_sqlite3_feed_drop_oldest (struct ml_sqlite3_feed *f)
+{
+  do
+    {
+      f->head = (f->head + 1) % f->size;
+      f->count--;
+    }
+  while (f->count > 0 && ! f->ring[f->head].first);
+  f->lost++;
+}
+
+static void
+ml_sqlite3_update_hook_cb (void *data, int op, const char *dbname,
+			   const char *table, sqlite3_int64 rowid)
+{
+  struct ml_sqlite3_feed *f = data;
+  struct ml_sqlite3_change *c;
+  int t;
+
+  if (f->truncated)
+    return;
+  if (f->pending == f->size)
+    {
+      f->truncated = TRUE;
+      return;
+    }
+  if (f->count + f->pending == f->size)
+    ml_sqlite3_feed_drop_oldest (f);
+  t = ml_sqlite3_feed_table (f, table);
+  if (t < 0)
+    {
+      f->truncated = TRUE;
+      return;
+    }
+  c = &f->ring[(f->head + f->count + f->pending) % f->size];
+  c->rowid = rowid;
+  c->table = t;
+  c->op    = op;
+  c->first = (f->pending == 0);
+  f->pending++;
+}
+
+static int
+ml_sqlite3_commit_hook_cb (void *data)
+{
+  struct ml_sqlite3_feed *f = data;
+  if (f->truncated)
+    f->lost++;
+  else
+    f->count += f->pending;
+  f->pending = 0;
+  f->truncated = FALSE;
+  return 0;
+}
+
+static void
+ml_sqlite3_rollback_hook_cb (void *data)
+{
+  struct ml_sqlite3_feed *f = data;
+  f->pending = 0;
+  f->truncated = FALSE;
+}
+
+/* Savepoints rolled back by Sqlite3_io.import: the records of the
+   current transaction added after the mark are dropped. -1 means no
+   feed. */
+int
+ml_sqlite3_feed_mark (value stmt)
+{
+  struct ml_sqlite3_watch *w = Sqlite3_stmt_watch (stmt);
+  if (w == NULL || w->data == NULL || w->data->feed == NULL)
+    return -1;
+  return w->data->feed->pending;
+}
+
+void
+ml_sqlite3_feed_rewind (value stmt, int mark)
+{
+  struct ml_sqlite3_watch *w = Sqlite3_stmt_watch (stmt);
+  struct ml_sqlite3_feed *f;
+  if (mark < 0 || w == NULL || w->data == NULL || w->data->feed == NULL)
+    return;
+  f = w->data->feed;
+  if (f->pending > (unsigned int) mark)
+    f->pending = mark;
+}
+
+static void
+ml_sqlite3_feed_destroy (struct ml_sqlite3_data *data)
+{
+  struct ml_sqlite3_feed *f = data->feed;
+  int i;
+  if (f == NULL)
+    return;
+  if (data->db != NULL)
+    {
+      sqlite3_update_hook (data->db, NULL, NULL);
+      sqlite3_commit_hook (data->db, NULL, NULL);
+      sqlite3_rollback_hook (data->db, NULL, NULL);
+    }
+  for (i=0; i<f->n_tables; i++)
+    sqlite3_free (f->tables[i]);
+  sqlite3_free (f->tables);
+  sqlite3_free (f->ring);
+  sqlite3_free (f);
+  data->feed = NULL;
+}
+
+CAMLprim value
+ml_sqlite3_change_feed_enable (value db, value size)
+{
+  struct ml_sqlite3_data *db_data = Sqlite3_data_val(db);
+  sqlite3 *s_db = Sqlite3_val (db);
+  struct ml_sqlite3_feed *f;
+
+  if (Long_val (size) <= 0)
+    caml_invalid_argument ("Sqlite3.change_feed_enable");
+  ml_sqlite3_feed_destroy (db_data);
+  f = sqlite3_malloc (sizeof *f);
+  if (f == NULL)
+    caml_raise_out_of_memory ();
+  memset (f, 0, sizeof *f);
+  f->size = Long_val (size);
+  f->last_table = -1;
+  f->ring = sqlite3_malloc (f->size * sizeof (struct ml_sqlite3_change));
+  if (f->ring == NULL)
+    {
+      sqlite3_free (f);
+      caml_raise_out_of_memory ();
+    }
+  db_data->feed = f;
+  sqlite3_update_hook (s_db, ml_sqlite3_update_hook_cb, f);
+  sqlite3_commit_hook (s_db, ml_sqlite3_commit_hook_cb, f);
+  sqlite3_rollback_hook (s_db, ml_sqlite3_rollback_hook_cb, f);
+  return Val_unit;
+}
+
+CAMLprim value
+ml_sqlite3_change_feed_disable (value db)
+{
+  ml_sqlite3_feed_destroy (Sqlite3_data_val(db));
+  return Val_unit;
+}
+
+#define MLTAG_INSERT  -1598038413L
+#define MLTAG_UPDATE   1930454035L
+#define MLTAG_DELETE    985061463L
+
+static value
+convert_sqlite3_op (int op)
+{
+  switch (op)
+    {
+    case SQLITE_INSERT:
+      return MLTAG_INSERT;
+    case SQLITE_UPDATE:
+      return MLTAG_UPDATE;
+    default:
+      return MLTAG_DELETE;
+    }
+}
+
+CAMLprim value
+ml_sqlite3_change_feed_drain (value db)
+{
+  CAMLparam1(db);
+  CAMLlocal5(r, batch, names, c, rowid);
+  struct ml_sqlite3_feed *f = Sqlite3_data_val(db)->feed;
+  unsigned int i, n, nbatch, b;
+
+  if (f == NULL || f->count == 0)
+    CAMLreturn (Atom (0));
+
+  nbatch = 0;
+  for (i=0; i<f->count; i++)
+    if (f->ring[(f->head + i) % f->size].first)
+      nbatch++;
+
+  r = caml_alloc (nbatch, 0);
+  names = caml_alloc (f->n_tables, 0);
+  for (b=0; b<nbatch; b++)
+    {
+      n = 1;
+      while (n < f->count && ! f->ring[(f->head + n) % f->size].first)
+	n++;
+      batch = caml_alloc (n, 0);
+      for (i=0; i<n; i++)
+	{
+	  struct ml_sqlite3_change *ch = &f->ring[(f->head + i) % f->size];
+	  if (Field (names, ch->table) == Val_unit)
+	    {
+	      c = caml_copy_string (f->tables[ch->table]);
+	      Store_field (names, ch->table, c);
+	    }
+	  rowid = caml_copy_int64 (ch->rowid);
+	  c = caml_alloc_small (3, 0);
+	  Field (c, 0) = convert_sqlite3_op (ch->op);
+	  Field (c, 1) = Field (names, ch->table);
+	  Field (c, 2) = rowid;
+	  Store_field (batch, i, c);
+	}
+      Store_field (r, b, batch);
+      f->head = (f->head + n) % f->size;
+      f->count -= n;
+    }
+  CAMLreturn (r);
+}
+
+CAMLprim value
+ml_sqlite3_change_feed_lost (value db)
+{
+  struct ml_sqlite3_feed *f = Sqlite3_data_val(db)->feed;
+  long lost = 0;
+  if (f != NULL)
+    {
+      lost = f->lost;
+      f->lost = 0;
+    }
+  return Val_long (lost);
+}
+
+
+
+static value
+convert_sqlite3_type (int t)
+{
+  switch (t)
+    {
+    case SQLITE_INTEGER:
+      return MLTAG_INTEGER;
+    case SQLITE_FLOAT:
+      return MLTAG_FLOAT;
+    case SQLITE_TEXT:
+      return MLTAG_TEXT;
+    case SQLITE_BLOB:
+      return MLTAG_BLOB;
+    default:
+      return MLTAG_NULL;
+    }
+}
+
+
+
+
+/* Prepared statements */
+
+CAMLprim value
+ml_sqlite3_finalize_noerr (value s)
+{
+  sqlite3_stmt **p_stmt = (sqlite3_stmt **) s;
+
+  if (*p_stmt != NULL)
+    {
+      sqlite3_finalize (*p_stmt);
+      *p_stmt = NULL;
+    }
+  if (Sqlite3_stmt_watch (s) != NULL)
+    {
+      ml_sqlite3_watch_release (Sqlite3_stmt_watch (s));
+      Sqlite3_stmt_watch (s) = NULL;
+    }
+  return Val_unit;
+}
+
+static sqlite3_stmt *
+ml_sqlite3_prepare_stmt (value db, value sql, value sql_off, unsigned int *tail_pos)
+{
+  CAMLparam2(db, sql);
+  sqlite3_stmt *stmt = NULL;
+  const char *tail;
+  int status;
+  unsigned int off = Unsigned_int_val (sql_off);
+  status = sqlite3_prepare_v2 (Sqlite3_val (db), 
+                               String_val (sql) + off,
+                               caml_string_length (sql) - off + 1,
+                               &stmt, &tail);
+  if (status != SQLITE_OK)
+    raise_sqlite3_exn (db);
+  if (tail_pos != NULL)
+    *tail_pos = tail - String_val (sql);
+  CAMLreturnT (sqlite3_stmt *, stmt);
+}
+
+CAMLprim value
+ml_sqlite3_prepare (value db, value sql, value sql_off)
+{
+  CAMLparam2(db, sql);
+  CAMLlocal3(t, o, s);
+  sqlite3_stmt *stmt;
+  struct ml_sqlite3_watch *w;
+  unsigned int tail_pos;
+
+  stmt = ml_sqlite3_prepare_stmt (db, sql, sql_off, &tail_pos);
+  if (stmt == NULL)
+    o = Val_unit;
+  else
+    {
+      w = ml_sqlite3_watch_ref (db);
+      s = caml_alloc_small (2, Abstract_tag);
+      Field (s, 0) = Val_bp (stmt);
+      Field (s, 1) = (value) w;
+      o = caml_alloc_small (1, 0);
+      Field (o, 0) = s;
+    }
+  t = caml_alloc_small (2, 0);
+  Field (t, 0) = o;
+  Field (t, 1) = Val_int (tail_pos);
+  CAMLreturn (t);
+}
+
+CAMLprim value
+ml_sqlite3_reset (value stmt)
+{
+  sqlite3_stmt *s = Sqlite3_stmt_val (stmt);
+  sqlite3_reset (s);
+  if (Sqlite3_stmt_watch (stmt) != NULL)
+    ml_sqlite3_watch_restart (Sqlite3_stmt_watch (stmt));
+  return Val_unit;
+}
+
+CAMLprim value
+ml_sqlite3_expired (value stmt)
+{
+  sqlite3_stmt *s = * ((sqlite3_stmt **) stmt);
+  return Val_bool (s == NULL);
+}
+
+void
+ml_sqlite3_raise_timeout (void)
+{
+  static value *timeout_exn;
+  if (timeout_exn == NULL)
+    {
+      timeout_exn = caml_named_value ("mlsqlite3_timeout_exn");
+      if (timeout_exn == NULL)
+	caml_failwith ("Sqlite3 exception not registered");
+    }
+  caml_raise_constant (*timeout_exn);
+}
+
+/* whether the last step of stmt was stopped by the deadline; the
+   flag is cleared */
+static int
+ml_sqlite3_timed_out (value stmt)
+{
+  struct ml_sqlite3_watch *w = Sqlite3_stmt_watch (stmt);
+  if (w == NULL || ! w->timed_out)
+    return FALSE;
+  w->timed_out = FALSE;
+  return TRUE;
+}
+
+static void
+ml_sqlite3_check_timeout (value stmt)
+{
+  if (ml_sqlite3_timed_out (stmt))
+    ml_sqlite3_raise_timeout ();
+}
+
+#define MLTAG_ROW	   8190965L
+#define MLTAG_DONE	1516073221L
+
+/* raises the exception of a collation called by the last step */
+static void
+ml_sqlite3_check_collation_exn (struct ml_sqlite3_watch *w)
+{
+  value exn;
+  if (w == NULL || w->data == NULL)
+    return;
+  exn = Field (w->data->callbacks, 3);
+  if (exn != Val_unit)
+    {
+      Store_field (w->data->callbacks, 3, Val_unit);
+      caml_raise (exn);
+    }
+}
+
+/* whether step_result would raise Timeout or the exception of a
+   collation for an interrupted step of stmt */
+int
+ml_sqlite3_interrupt_pending (value stmt)
+{
+  struct ml_sqlite3_watch *w = Sqlite3_stmt_watch (stmt);
+  return w != NULL
+    && (w->timed_out
+	|| (w->data != NULL && Field (w->data->callbacks, 3) != Val_unit));
+}
+
+value
+ml_sqlite3_step_result (value stmt, int status)
+{
+  ml_sqlite3_check_collation_exn (Sqlite3_stmt_watch (stmt));
+  switch (status)
+    {
+    case SQLITE_ROW:
+      return MLTAG_ROW;
+    case SQLITE_DONE:
+      return MLTAG_DONE;
+    default:
+      {
+	sqlite3 *db;
+	db = sqlite3_db_handle (Sqlite3_stmt_val (stmt));
+	if (status == SQLITE_INTERRUPT)
+	  ml_sqlite3_check_timeout (stmt);
+	ml_sqlite3_raise_exn (status, sqlite3_errmsg (db), TRUE);
+      }
+    }
+}
+
+/* Called before stepping stmt. A cancel or a timeout only applies to
+   the execution of the statement it interrupted: they are forgotten
+   when a statement starts anew. */
+void
+ml_sqlite3_step_start (value stmt)
+{
+#ifdef HAVE_SQLITE3_STMT_BUSY
+  if (Sqlite3_stmt_watch (stmt) != NULL
+      && ! sqlite3_stmt_busy (Sqlite3_stmt_val (stmt)))
+    ml_sqlite3_watch_restart (Sqlite3_stmt_watch (stmt));
+#endif
+}
+
+/* The runtime lock is released during the step when no OCaml code can
+   run from it, so that other threads, e.g. one calling cancel, can
+   proceed. stmt is a local root: it can't be finalized meanwhile. */
+CAMLprim value
+ml_sqlite3_step (value stmt)
+{
+  CAMLparam1(stmt);
+  sqlite3_stmt *s = Sqlite3_stmt_val (stmt);
+  struct ml_sqlite3_watch *w = Sqlite3_stmt_watch (stmt);
+  int status;
+  ml_sqlite3_step_start (stmt);
+  if (w != NULL && ! ml_sqlite3_watch_runs_ocaml (w))
+    {
+      caml_enter_blocking_section ();
+      status = sqlite3_step (s);
+      caml_leave_blocking_section ();
+    }
+  else
+    status = sqlite3_step (s);
+  CAMLreturn (ml_sqlite3_step_result (stmt, status));
+}
+
+#if defined(HAVE_SQLITE3_UNLOCK_NOTIFY) && defined(HAVE_PTHREAD)
+struct ml_sqlite3_unlock {
+  int fired;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void
+ml_sqlite3_unlock_notify_cb (void **args, int n)
+{
+  int i;
+  for (i=0; i<n; i++)
+    {
+      struct ml_sqlite3_unlock *u = args[i];
+      pthread_mutex_lock (&u->mutex);
+      u->fired = TRUE;
+      pthread_cond_signal (&u->cond);
+      pthread_mutex_unlock (&u->mutex);
+    }
+}
+
+/* Wait until the connection blocking db ends its transaction. The
+   runtime lock is released before registering the notification, so
+   that the blocking connection can proceed if it's used by another
+   OCaml thread. */
+static int
+ml_sqlite3_wait_unlock (sqlite3 *db)
+{
+  struct ml_sqlite3_unlock u;
+  int status;
+  u.fired = FALSE;
+  pthread_mutex_init (&u.mutex, NULL);
+  pthread_cond_init (&u.cond, NULL);
+  caml_enter_blocking_section ();
+  status = sqlite3_unlock_notify (db, ml_sqlite3_unlock_notify_cb, &u);
+  if (status == SQLITE_OK)
+    {
+      pthread_mutex_lock (&u.mutex);
+      while (! u.fired)
+	pthread_cond_wait (&u.cond, &u.mutex);
+      pthread_mutex_unlock (&u.mutex);
+    }
+  caml_leave_blocking_section ();
+  pthread_cond_destroy (&u.cond);
+  pthread_mutex_destroy (&u.mutex);
+  return status;
+}
+#endif
+
+CAMLprim value
+ml_sqlite3_step_blocking (value stmt)
+{
+#if defined(HAVE_SQLITE3_UNLOCK_NOTIFY) && defined(HAVE_PTHREAD)
+  CAMLparam1(stmt);
+  sqlite3_stmt *s = Sqlite3_stmt_val (stmt);
+  sqlite3 *db = sqlite3_db_handle (s);
+  int status;
+  ml_sqlite3_step_start (stmt);
+  while ((status = sqlite3_step (s)) == SQLITE_LOCKED
+	 && sqlite3_extended_errcode (db) == SQLITE_LOCKED_SHAREDCACHE)
+    {
+      if (ml_sqlite3_wait_unlock (db) != SQLITE_OK)
+	ml_sqlite3_raise_exn (SQLITE_LOCKED, "unlock_notify: deadlock detected", TRUE);
+      sqlite3_reset (s);
+    }
+  CAMLreturn (ml_sqlite3_step_result (stmt, status));
+#else
+  caml_failwith ("sqlite3_unlock_notify unavailable");
+#endif
+}
+
+
+
+/* sqlite3_bind_* */
+
+/* also used by the cursors, whose statements have no OCaml block */
+void
+ml_sqlite3_bind_stmt (sqlite3_stmt *stmt, value idx, value v)
+{
+  int i = Int_val (idx);
+  int status;
+
+  if (Is_long (v))
     status = sqlite3_bind_null (stmt, i);
   else
     {
@@ -559,6 +1601,12 @@ ml_sqlite3_bind (value s, value idx, value v)
     }
   if (status != SQLITE_OK)
     ml_sqlite3_raise_exn (status, "sqlite3_bind failed", TRUE);
+}
+
+CAMLprim value
+ml_sqlite3_bind (value s, value idx, value v)
+{
+  ml_sqlite3_bind_stmt (Sqlite3_stmt_val (s), idx, v);
   return Val_unit;
 }
 
@@ -690,7 +1738,7 @@ ml_sqlite3_column_decltype (value s, value i)
 /* User-defined functions */
 
 static value
-ml_sqlite3_wrap_values (int argc, sqlite3_value **args)
+ml_sqlite3_wrap_values (sqlite3_context *ctx, int argc, sqlite3_value **args)
 {
   int i;
   CAMLparam0();
@@ -700,8 +1748,11 @@ ml_sqlite3_wrap_values (int argc, sqlite3_value **args)
   a = caml_alloc (argc, 0);
   for (i=0; i<argc; i++)
     {
-      v = caml_alloc_small (1, Abstract_tag);
+      /* the context and the index are kept for the auxdata */
+      v = caml_alloc_small (3, Abstract_tag);
       Field (v, 0) = Val_bp (args[i]);
+      Field (v, 1) = Val_bp (ctx);
+      Field (v, 2) = Val_int (i);
       Store_field (a, i, v);
     }
   CAMLreturn (a);
@@ -712,7 +1763,10 @@ ml_sqlite3_wipe_values (value a)
 {
   mlsize_t i, len = Wosize_val (a);
   for (i=0; i<len; i++)
-    Store_field (Field (a, i), 0, 0);
+    {
+      Store_field (Field (a, i), 0, 0);
+      Store_field (Field (a, i), 1, 0);
+    }
 }
 
 CAMLprim value
@@ -767,6 +1821,37 @@ ml_sqlite3_value_type (value v)
   return convert_sqlite3_type (sqlite3_value_type (Sqlite3_value_val (v)));
 }
 
+/* The auxdata is an OCaml value in a global root, removed by SQLite
+   when the argument changes or the statement is finalized. */
+CAMLprim value
+ml_sqlite3_get_auxdata (value v)
+{
+  CAMLparam1(v);
+  CAMLlocal1(r);
+  sqlite3_context *ctx = (sqlite3_context *) Field (v, 1);
+  value *p;
+  if (ctx == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "no auxdata for this value", TRUE);
+  p = sqlite3_get_auxdata (ctx, Int_val (Field (v, 2)));
+  if (p == NULL)
+    CAMLreturn (Val_unit);
+  r = caml_alloc_small (1, 0);
+  Field (r, 0) = *p;
+  CAMLreturn (r);
+}
+
+CAMLprim value
+ml_sqlite3_set_auxdata (value v, value data)
+{
+  sqlite3_context *ctx = (sqlite3_context *) Field (v, 1);
+  if (ctx == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "no auxdata for this value", TRUE);
+  sqlite3_set_auxdata (ctx, Int_val (Field (v, 2)),
+		       ml_sqlite3_global_root_new (data),
+		       ml_sqlite3_global_root_destroy);
+  return Val_unit;
+}
+
 static void 
 ml_sqlite3_set_result (sqlite3_context *ctx, value res)
 {
@@ -812,7 +1897,7 @@ ml_sqlite3_user_function (sqlite3_context *ctx, int argc, sqlite3_value **argv)
   CAMLparam0();
   CAMLlocal2(res, args);
 
-  args = ml_sqlite3_wrap_values (argc, argv);
+  args = ml_sqlite3_wrap_values (ctx, argc, argv);
   res = caml_callback_exn (*fun, args);
   ml_sqlite3_set_result (ctx, res);
   ml_sqlite3_wipe_values (args);
@@ -834,6 +1919,7 @@ ml_sqlite3_create_function (value db, value name, value nargs, value fun)
                                        ml_sqlite3_global_root_destroy);
   if (status != SQLITE_OK)
     raise_sqlite3_exn (db);
+  ml_sqlite3_watch_get (db)->ocaml_funcs++;
   CAMLreturn(Val_unit);
 }
 
@@ -850,3 +1936,613 @@ ml_sqlite3_delete_function (value db, value name)
     raise_sqlite3_exn (db);
   return Val_unit;
 }
+
+
+/* Collations */
+
+/* The operands are copied into two scratch strings that are reused
+   from one comparison to the next, so no OCaml string is allocated
+   for each comparison. A collation can't report an error to SQLite:
+   when the comparison function raises, the exception is kept on the
+   connection, the statement is interrupted and step raises it. */
+struct ml_sqlite3_collation {
+  value fun;
+  value buf[2];
+  struct ml_sqlite3_watch *watch;
+};
+
+static void
+ml_sqlite3_collation_destroy (void *data)
+{
+  struct ml_sqlite3_collation *c = data;
+  caml_remove_global_root (&c->fun);
+  caml_remove_global_root (&c->buf[0]);
+  caml_remove_global_root (&c->buf[1]);
+  ml_sqlite3_watch_release (c->watch);
+  caml_stat_free (c);
+}
+
+static void
+ml_sqlite3_collation_fill (value *buf, const void *data, int len)
+{
+  mlsize_t size = caml_string_length (*buf);
+  if (size < (mlsize_t) len)
+    {
+      while (size < (mlsize_t) len)
+	size *= 2;
+      *buf = caml_alloc_string (size);
+    }
+  memcpy (Bp_val (*buf), data, len);
+}
+
+static int
+ml_sqlite3_collation_cb (void *data, int len1, const void *s1, 
+			 int len2, const void *s2)
+{
+  struct ml_sqlite3_collation *c = data;
+  value args[4];
+  value res;
+  ml_sqlite3_collation_fill (&c->buf[0], s1, len1);
+  ml_sqlite3_collation_fill (&c->buf[1], s2, len2);
+  args[0] = c->buf[0];
+  args[1] = Val_int (len1);
+  args[2] = c->buf[1];
+  args[3] = Val_int (len2);
+  res = caml_callbackN_exn (c->fun, 4, args);
+  if (Is_exception_result (res))
+    {
+      struct ml_sqlite3_data *d = c->watch->data;
+      if (d != NULL)
+	{
+	  if (Field (d->callbacks, 3) == Val_unit)
+	    Store_field (d->callbacks, 3, Extract_exception (res));
+	  sqlite3_interrupt (d->db);
+	}
+      return 0;
+    }
+  return Int_val (res);
+}
+
+CAMLprim value
+ml_sqlite3_create_collation (value db, value name, value fun)
+{
+  CAMLparam3(db, name, fun);
+  struct ml_sqlite3_collation *c;
+  sqlite3 *s_db = Sqlite3_val (db);
+  int status;
+
+  c = caml_stat_alloc (sizeof *c);
+  c->watch = ml_sqlite3_watch_ref (db);
+  c->fun = fun;
+  c->buf[0] = Val_unit;
+  c->buf[1] = Val_unit;
+  caml_register_global_root (&c->fun);
+  caml_register_global_root (&c->buf[0]);
+  caml_register_global_root (&c->buf[1]);
+  c->buf[0] = caml_alloc_string (64);
+  c->buf[1] = caml_alloc_string (64);
+  status = sqlite3_create_collation_v2 (s_db, String_val (name),
+					SQLITE_UTF8, c,
+					ml_sqlite3_collation_cb,
+					ml_sqlite3_collation_destroy);
+  if (status != SQLITE_OK)
+    {
+      ml_sqlite3_collation_destroy (c);
+      raise_sqlite3_exn (db);
+    }
+  c->watch->ocaml_funcs++;
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value
+ml_sqlite3_delete_collation (value db, value name)
+{
+  int status;
+  status = sqlite3_create_collation_v2 (Sqlite3_val (db), String_val (name),
+					SQLITE_UTF8, NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+    raise_sqlite3_exn (db);
+  return Val_unit;
+}
+
+/* Native collations */
+
+#define Is_digit(c)	((c) >= '0' && (c) <= '9')
+#define Ascii_lower(c)	((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+static int
+ml_sqlite3_cmp_int (int a, int b)
+{
+  return (a > b) - (a < b);
+}
+
+/* digit runs are compared by numeric value, the rest bytewise */
+static int
+ml_sqlite3_collate_natural (void *data, int len1, const void *s1, 
+			    int len2, const void *s2)
+{
+  const unsigned char *a = s1, *b = s2;
+  int i = 0, j = 0;
+  while (i < len1 && j < len2)
+    {
+      if (Is_digit (a[i]) && Is_digit (b[j]))
+	{
+	  int si, sj, r;
+	  while (i < len1 && a[i] == '0')
+	    i++;
+	  while (j < len2 && b[j] == '0')
+	    j++;
+	  si = i;
+	  sj = j;
+	  while (i < len1 && Is_digit (a[i]))
+	    i++;
+	  while (j < len2 && Is_digit (b[j]))
+	    j++;
+	  if (i - si != j - sj)
+	    return ml_sqlite3_cmp_int (i - si, j - sj);
+	  r = memcmp (a + si, b + sj, i - si);
+	  if (r != 0)
+	    return r;
+	}
+      else if (a[i] != b[j])
+	return ml_sqlite3_cmp_int (a[i], b[j]);
+      else
+	{
+	  i++;
+	  j++;
+	}
+    }
+  return ml_sqlite3_cmp_int (len1 - i, len2 - j);
+}
+
+/* shorter strings first, then ASCII case-insensitive */
+static int
+ml_sqlite3_collate_casefold (void *data, int len1, const void *s1, 
+			     int len2, const void *s2)
+{
+  const unsigned char *a = s1, *b = s2;
+  int i;
+  if (len1 != len2)
+    return ml_sqlite3_cmp_int (len1, len2);
+  for (i=0; i<len1; i++)
+    if (a[i] != b[i])
+      {
+	int ca = Ascii_lower (a[i]);
+	int cb = Ascii_lower (b[i]);
+	if (ca != cb)
+	  return ml_sqlite3_cmp_int (ca, cb);
+      }
+  return 0;
+}
+
+/* bytewise, starting from the end of the strings */
+static int
+ml_sqlite3_collate_reverse (void *data, int len1, const void *s1, 
+			    int len2, const void *s2)
+{
+  const unsigned char *a = s1, *b = s2;
+  int i, n = len1 < len2 ? len1 : len2;
+  for (i=1; i<=n; i++)
+    if (a[len1 - i] != b[len2 - i])
+      return ml_sqlite3_cmp_int (a[len1 - i], b[len2 - i]);
+  return ml_sqlite3_cmp_int (len1, len2);
+}
+
+#define MLTAG_NATURAL   2108023699L
+#define MLTAG_CASEFOLD  1071269219L
+#define MLTAG_REVERSE    899684869L
+
+CAMLprim value
+ml_sqlite3_create_native_collation (value db, value name, value kind)
+{
+  int (*cmp)(void *, int, const void *, int, const void *);
+  int status;
+  switch (kind)
+    {
+    case MLTAG_NATURAL:
+      cmp = ml_sqlite3_collate_natural; break;
+    case MLTAG_CASEFOLD:
+      cmp = ml_sqlite3_collate_casefold; break;
+    case MLTAG_REVERSE:
+      cmp = ml_sqlite3_collate_reverse; break;
+    default:
+      caml_invalid_argument ("Sqlite3.create_native_collation");
+    }
+  status = sqlite3_create_collation_v2 (Sqlite3_val (db), String_val (name),
+					SQLITE_UTF8, NULL, cmp, NULL);
+  if (status != SQLITE_OK)
+    raise_sqlite3_exn (db);
+  return Val_unit;
+}
+
+
+/* FTS5 */
+
+/* The fts5_api of a connection is fetched with SELECT fts5(?1), the
+   address where to store it being bound with sqlite3_bind_pointer. */
+
+#define MLTAG_DOCUMENT  -382665161L
+#define MLTAG_QUERY    -1213102639L
+#define MLTAG_PREFIX   -1032647899L
+#define MLTAG_AUX          6502857L
+
+#ifdef HAVE_SQLITE3_BIND_POINTER
+static fts5_api *
+ml_sqlite3_fts5_api (value db)
+{
+  sqlite3 *s_db = Sqlite3_val (db);
+  sqlite3_stmt *stmt;
+  fts5_api *api = NULL;
+
+  if (sqlite3_prepare_v2 (s_db, "SELECT fts5(?1)", -1, &stmt, NULL) == SQLITE_OK)
+    {
+      sqlite3_bind_pointer (stmt, 1, &api, "fts5_api_ptr", NULL);
+      sqlite3_step (stmt);
+      sqlite3_finalize (stmt);
+    }
+  if (api == NULL)
+    ml_sqlite3_raise_exn (SQLITE_ERROR, "FTS5 unavailable", TRUE);
+  return api;
+}
+
+/* Tokenizers: xCreate applies the OCaml function to the arguments and
+   keeps the closure it returns; xTokenize calls this closure once per
+   text and it returns all the tokens at once. */
+
+static int
+ml_sqlite3_tokenizer_create (void *data, const char **argv, int argc,
+			     Fts5Tokenizer **tok)
+{
+  value *create = data;
+  CAMLparam0();
+  CAMLlocal3(args, s, res);
+  int i;
+
+  args = caml_alloc (argc, 0);
+  for (i=0; i<argc; i++)
+    {
+      s = caml_copy_string (argv[i]);
+      Store_field (args, i, s);
+    }
+  res = caml_callback_exn (*create, argc > 0 ? args : Atom (0));
+  if (Is_exception_result (res))
+    CAMLreturnT (int, SQLITE_ERROR);
+  *tok = (Fts5Tokenizer *) ml_sqlite3_global_root_new (res);
+  CAMLreturnT (int, SQLITE_OK);
+}
+
+static void
+ml_sqlite3_tokenizer_delete (Fts5Tokenizer *tok)
+{
+  ml_sqlite3_global_root_destroy (tok);
+}
+
+static int
+ml_sqlite3_tokenizer_tokenize (Fts5Tokenizer *tok, void *ctx, int flags,
+			       const char *text, int len,
+			       int (*token)(void *, int, const char *, int, int, int))
+{
+  value *fun = (value *) tok;
+  CAMLparam0();
+  CAMLlocal3(s, res, t);
+  value reason;
+  mlsize_t i, n;
+  int status = SQLITE_OK;
+
+  if (flags == FTS5_TOKENIZE_DOCUMENT)
+    reason = MLTAG_DOCUMENT;
+  else if (flags & FTS5_TOKENIZE_PREFIX)
+    reason = MLTAG_PREFIX;
+  else if (flags & FTS5_TOKENIZE_QUERY)
+    reason = MLTAG_QUERY;
+  else
+    reason = MLTAG_AUX;
+  s = caml_alloc_string (len);
+  memcpy (Bp_val (s), text, len);
+  res = caml_callback2_exn (*fun, reason, s);
+  if (Is_exception_result (res))
+    CAMLreturnT (int, SQLITE_ERROR);
+
+  n = Wosize_val (res);
+  for (i=0; i<n && status == SQLITE_OK; i++)
+    {
+      long start, end;
+      t = Field (res, i);
+      start = Long_val (Field (t, 1));
+      end = Long_val (Field (t, 2));
+      if (start < 0 || end < start || end > len)
+	status = SQLITE_ERROR;
+      else
+	status = token (ctx, 0, String_val (Field (t, 0)),
+			caml_string_length (Field (t, 0)), start, end);
+    }
+  CAMLreturnT (int, status);
+}
+#endif
+
+CAMLprim value
+ml_sqlite3_fts5_create_tokenizer (value db, value name, value create)
+{
+#ifdef HAVE_SQLITE3_BIND_POINTER
+  CAMLparam3(db, name, create);
+  fts5_api *api = ml_sqlite3_fts5_api (db);
+  fts5_tokenizer tok;
+  int status;
+
+  tok.xCreate   = ml_sqlite3_tokenizer_create;
+  tok.xDelete   = ml_sqlite3_tokenizer_delete;
+  tok.xTokenize = ml_sqlite3_tokenizer_tokenize;
+  status = api->xCreateTokenizer (api, String_val (name),
+				  ml_sqlite3_global_root_new (create), &tok,
+				  ml_sqlite3_global_root_destroy);
+  if (status != SQLITE_OK)
+    ml_sqlite3_raise_exn (status, "cannot create tokenizer", TRUE);
+  ml_sqlite3_watch_get (db)->ocaml_funcs++;
+  CAMLreturn (Val_unit);
+#else
+  caml_failwith ("sqlite3_bind_pointer unavailable");
+#endif
+}
+
+/* Auxiliary functions receive an fts5_context that is only valid
+   during the call; it is wiped afterwards, like the arguments. */
+
+#ifdef HAVE_SQLITE3_BIND_POINTER
+static void
+ml_sqlite3_fts5_function (const Fts5ExtensionApi *api, Fts5Context *fts,
+			  sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  value *fun = api->xUserData (fts);
+  CAMLparam0();
+  CAMLlocal3(c, args, res);
+
+  c = caml_alloc_small (2, Abstract_tag);
+  Field (c, 0) = Val_bp (api);
+  Field (c, 1) = Val_bp (fts);
+  args = ml_sqlite3_wrap_values (NULL, argc, argv);
+  res = caml_callback2_exn (*fun, c, args);
+  ml_sqlite3_set_result (ctx, res);
+  ml_sqlite3_wipe_values (args);
+  Field (c, 0) = 0;
+  Field (c, 1) = 0;
+  CAMLreturn0;
+}
+
+static const Fts5ExtensionApi *
+ml_sqlite3_fts5_ctx (value c, Fts5Context **fts)
+{
+  const Fts5ExtensionApi *api = (const Fts5ExtensionApi *) Field (c, 0);
+  if (api == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "invalid fts5 context", TRUE);
+  *fts = (Fts5Context *) Field (c, 1);
+  return api;
+}
+
+#define Fts5_check(s)	do { int _s = (s); if (_s != SQLITE_OK) ml_sqlite3_raise_exn (_s, "fts5 error", TRUE); } while (0)
+#endif
+
+CAMLprim value
+ml_sqlite3_fts5_create_function (value db, value name, value fun)
+{
+#ifdef HAVE_SQLITE3_BIND_POINTER
+  CAMLparam3(db, name, fun);
+  fts5_api *api = ml_sqlite3_fts5_api (db);
+  int status;
+
+  status = api->xCreateFunction (api, String_val (name),
+				 ml_sqlite3_global_root_new (fun),
+				 ml_sqlite3_fts5_function,
+				 ml_sqlite3_global_root_destroy);
+  if (status != SQLITE_OK)
+    ml_sqlite3_raise_exn (status, "cannot create auxiliary function", TRUE);
+  ml_sqlite3_watch_get (db)->ocaml_funcs++;
+  CAMLreturn (Val_unit);
+#else
+  caml_failwith ("sqlite3_bind_pointer unavailable");
+#endif
+}
+
+#ifdef HAVE_SQLITE3_BIND_POINTER
+CAMLprim value
+ml_sqlite3_fts5_column_count (value c)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  return Val_int (api->xColumnCount (fts));
+}
+
+CAMLprim value
+ml_sqlite3_fts5_row_count (value c)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  sqlite3_int64 n;
+  Fts5_check (api->xRowCount (fts, &n));
+  return caml_copy_int64 (n);
+}
+
+CAMLprim value
+ml_sqlite3_fts5_column_total_size (value c, value col)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  sqlite3_int64 n;
+  Fts5_check (api->xColumnTotalSize (fts, Int_val (col), &n));
+  return caml_copy_int64 (n);
+}
+
+CAMLprim value
+ml_sqlite3_fts5_column_size (value c, value col)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  int n;
+  Fts5_check (api->xColumnSize (fts, Int_val (col), &n));
+  return Val_int (n);
+}
+
+CAMLprim value
+ml_sqlite3_fts5_column_text (value c, value col)
+{
+  CAMLparam2(c, col);
+  CAMLlocal1(r);
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  const char *text;
+  int len;
+  Fts5_check (api->xColumnText (fts, Int_val (col), &text, &len));
+  r = caml_alloc_string (len);
+  memcpy (Bp_val (r), text, len);
+  CAMLreturn (r);
+}
+
+CAMLprim value
+ml_sqlite3_fts5_phrase_count (value c)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  return Val_int (api->xPhraseCount (fts));
+}
+
+CAMLprim value
+ml_sqlite3_fts5_phrase_size (value c, value phrase)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  return Val_int (api->xPhraseSize (fts, Int_val (phrase)));
+}
+
+CAMLprim value
+ml_sqlite3_fts5_rowid (value c)
+{
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  return caml_copy_int64 (api->xRowid (fts));
+}
+
+/* all the phrase instances of the current row at once */
+CAMLprim value
+ml_sqlite3_fts5_insts (value c)
+{
+  CAMLparam1(c);
+  CAMLlocal2(r, t);
+  Fts5Context *fts;
+  const Fts5ExtensionApi *api = ml_sqlite3_fts5_ctx (c, &fts);
+  int i, n, phrase, col, off;
+
+  Fts5_check (api->xInstCount (fts, &n));
+  if (n == 0)
+    CAMLreturn (Atom (0));
+  r = caml_alloc (n, 0);
+  for (i=0; i<n; i++)
+    {
+      Fts5_check (api->xInst (fts, i, &phrase, &col, &off));
+      t = caml_alloc_small (3, 0);
+      Field (t, 0) = Val_int (phrase);
+      Field (t, 1) = Val_int (col);
+      Field (t, 2) = Val_int (off);
+      Store_field (r, i, t);
+    }
+  CAMLreturn (r);
+}
+#else
+#define Fts5_unavailable(f) \
+  CAMLprim value f () { caml_failwith ("sqlite3_bind_pointer unavailable"); }
+Fts5_unavailable (ml_sqlite3_fts5_column_count)
+Fts5_unavailable (ml_sqlite3_fts5_row_count)
+Fts5_unavailable (ml_sqlite3_fts5_column_total_size)
+Fts5_unavailable (ml_sqlite3_fts5_column_size)
+Fts5_unavailable (ml_sqlite3_fts5_column_text)
+Fts5_unavailable (ml_sqlite3_fts5_phrase_count)
+Fts5_unavailable (ml_sqlite3_fts5_phrase_size)
+Fts5_unavailable (ml_sqlite3_fts5_rowid)
+Fts5_unavailable (ml_sqlite3_fts5_insts)
+#endif
+
+
+/* Snapshots */
+
+#ifdef HAVE_SQLITE3_SNAPSHOT_GET
+static void
+ml_finalize_snapshot (value v)
+{
+  sqlite3_snapshot *s = Sqlite3_snapshot_val (v);
+  if (s != NULL)
+    sqlite3_snapshot_free (s);
+}
+#endif
+
+CAMLprim value
+ml_sqlite3_snapshot_get (value db, value schema)
+{
+#ifdef HAVE_SQLITE3_SNAPSHOT_GET
+  static struct custom_operations ops = {
+    "mlsqlite3/snapshot/001",
+    ml_finalize_snapshot,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+#ifdef custom_compare_ext_default
+    custom_compare_ext_default
+#endif
+  };
+  sqlite3_snapshot *s;
+  value v;
+  int status;
+
+  status = sqlite3_snapshot_get (Sqlite3_val (db), String_val (schema), &s);
+  if (status != SQLITE_OK)
+    raise_sqlite3_exn (db);
+  v = caml_alloc_custom (&ops, sizeof s, 1, 100);
+  Sqlite3_snapshot_val (v) = s;
+  return v;
+#else
+  caml_failwith ("sqlite3_snapshot_get unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_snapshot_open (value db, value schema, value snap)
+{
+#ifdef HAVE_SQLITE3_SNAPSHOT_GET
+  sqlite3_snapshot *s = Sqlite3_snapshot_val (snap);
+  int status;
+  if (s == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "freed snapshot", TRUE);
+  status = sqlite3_snapshot_open (Sqlite3_val (db), String_val (schema), s);
+  if (status != SQLITE_OK)
+    raise_sqlite3_exn (db);
+  return Val_unit;
+#else
+  caml_failwith ("sqlite3_snapshot_open unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_snapshot_cmp (value snap1, value snap2)
+{
+#ifdef HAVE_SQLITE3_SNAPSHOT_GET
+  sqlite3_snapshot *s1 = Sqlite3_snapshot_val (snap1);
+  sqlite3_snapshot *s2 = Sqlite3_snapshot_val (snap2);
+  if (s1 == NULL || s2 == NULL)
+    ml_sqlite3_raise_exn (SQLITE_MISUSE, "freed snapshot", TRUE);
+  return Val_int (sqlite3_snapshot_cmp (s1, s2));
+#else
+  caml_failwith ("sqlite3_snapshot_cmp unavailable");
+#endif
+}
+
+CAMLprim value
+ml_sqlite3_snapshot_free (value snap)
+{
+#ifdef HAVE_SQLITE3_SNAPSHOT_GET
+  sqlite3_snapshot *s = Sqlite3_snapshot_val (snap);
+  if (s != NULL)
+    {
+      Sqlite3_snapshot_val (snap) = NULL;
+      sqlite3_snapshot_free (s);
+    }
+#endif
+  return Val_unit;
+}
@@ -4,23 +4,66 @@
 #define TRUE  1
 #define FALSE 0
 
+/* compatibility for OCaml < 3.10 */
+#ifndef CAMLreturnT
+# define CAMLreturnT(t,e) CAMLreturn(e)
+#endif
+
 void ml_sqlite3_raise_exn (int, const char *, int) Noreturn;
+sqlite3_int64 ml_sqlite3_now (void);
+void ml_sqlite3_bind_stmt (sqlite3_stmt *, value, value);
+value ml_sqlite3_step_result (value, int);
+void ml_sqlite3_step_start (value);
+int ml_sqlite3_interrupt_pending (value);
+int ml_sqlite3_feed_mark (value);
+void ml_sqlite3_feed_rewind (value, int);
+void ml_sqlite3_raise_timeout (void) Noreturn;
 #define raise_sqlite3_exn(db)	ml_sqlite3_raise_exn (sqlite3_errcode (Sqlite3_val(db)), sqlite3_errmsg (Sqlite3_val(db)), TRUE)
 
 
+/* hashes of the sql_type and sql_value constructors */
+#define MLTAG_INTEGER  769598269L
+#define MLTAG_FLOAT     17431289L
+#define MLTAG_TEXT    1869949275L
+#define MLTAG_BLOB    1471417019L
+#define MLTAG_NULL    1738460431L
+
+#define MLTAG_INT        7295391L
+#define MLTAG_INT64   2015220635L
+#define MLTAG_VALUE   1598910115L
+
+
 #if defined(__GNUC__) && (__GNUC__ >= 3)
 # define Pure	__attribute__ ((pure))
 #else
 # define Pure
 #endif
 
+struct ml_sqlite3_feed;
+struct ml_sqlite3_watch;
+struct ml_sqlite3_busy;
+struct ml_sqlite3_qlog;
+
+struct ml_sqlite3_watch *ml_sqlite3_watch_ref (value);
+void ml_sqlite3_watch_release (struct ml_sqlite3_watch *);
+sqlite3_int64 ml_sqlite3_watch_deadline (struct ml_sqlite3_watch *);
+int ml_sqlite3_watch_expired (struct ml_sqlite3_watch *, sqlite3_int64, int *);
+
 struct ml_sqlite3_data {
   sqlite3 *db;
   value  callbacks;
   value  stmt_store;
+  struct ml_sqlite3_feed *feed;
+  struct ml_sqlite3_watch *watch;
+  struct ml_sqlite3_busy *busy;
+  struct ml_sqlite3_qlog *qlog;
 };
 
+/* statements are abstract blocks holding the sqlite3_stmt and a
+   reference to the watch of their connection */
+#define Sqlite3_stmt_watch(v)	(((struct ml_sqlite3_watch **) (v)) [1])
 #define Sqlite3_data_val(v)	(* ((struct ml_sqlite3_data **) Data_custom_val(v)))
+#define Sqlite3_snapshot_val(v)	(* ((sqlite3_snapshot **) Data_custom_val(v)))
 
 static sqlite3 *	Sqlite3_val       (value) Pure;
 static sqlite3_stmt *	Sqlite3_stmt_val  (value) Pure;
@@ -85,14 +85,22 @@ type error_code =
   | RANGE
   | NOTADB
 exception Error of error_code * string
+exception Timeout
 
 let init =
-  Callback.register_exception "mlsqlite3_exn" (Error (ERROR, ""))
+  Callback.register_exception "mlsqlite3_exn" (Error (ERROR, "")) ;
+  Callback.register_exception "mlsqlite3_timeout_exn" Timeout
 
 
 external open_db  : string -> db = "ml_sqlite3_open"
+external open_db_vfs : vfs:string -> string -> db = "ml_sqlite3_open_vfs"
 external _close_db : db -> unit = "ml_sqlite3_close"
 
+external _memvfs_register : string -> bool -> unit = "ml_sqlite3_memvfs_register"
+let memvfs_register ?(default=false) name =
+  _memvfs_register name default
+external memvfs_delete : string -> string -> unit = "ml_sqlite3_memvfs_delete"
+
 external set_stmt_store : db -> stmt Weak_store.t option -> unit = "ml_sqlite3_set_stmt_store"
 external get_stmt_store : db -> stmt Weak_store.t = "ml_sqlite3_get_stmt_store"
 
@@ -137,19 +145,47 @@ external busy_set : db -> (int -> [`FAIL|`RETRY]) -> unit
    = "ml_sqlite3_busy_handler"
 external busy_unset : db -> unit = "ml_sqlite3_busy_handler_unset"
 external busy_timeout : db -> int -> unit = "ml_sqlite3_busy_timeout"
+external _busy_backoff : db -> int -> int -> int -> unit = "ml_sqlite3_busy_backoff"
+let busy_backoff ?(base=1) ?(cap=100) db timeout =
+  _busy_backoff db base cap timeout
+external busy_stats : db -> int * int * int = "ml_sqlite3_busy_stats"
 
 external trace_set   : db -> (string -> unit) -> unit = "ml_sqlite3_trace"
 external trace_unset : db -> unit = "ml_sqlite3_trace_unset"
 
+external _query_log_enable : db -> int -> int -> int -> unit = "ml_sqlite3_query_log_enable"
+let query_log_enable ?(sample=0) ?(slow=(-1)) db size =
+  _query_log_enable db sample slow size
+external query_log_disable : db -> unit = "ml_sqlite3_query_log_disable"
+external query_log_drain : db -> (float * float * string * int) array
+  = "ml_sqlite3_query_log_drain"
+
 external progress_handler_set : db -> int -> (unit -> unit) -> unit 
   = "ml_sqlite3_progress_handler"
 external progress_handler_unset : db -> unit = "ml_sqlite3_progress_handler_unset"
 
+external _deadline_set : db -> int -> int -> unit = "ml_sqlite3_deadline_set"
+let deadline_set ?(period=1000) db ms =
+  _deadline_set db period ms
+external deadline_clear : db -> unit = "ml_sqlite3_deadline_clear"
+
+type cancel_token
+external cancel_token : db -> cancel_token = "ml_sqlite3_cancel_token"
+external cancel : cancel_token -> unit = "ml_sqlite3_cancel"
+
+type change_op = [`INSERT|`UPDATE|`DELETE]
+external change_feed_enable  : db -> int -> unit = "ml_sqlite3_change_feed_enable"
+external change_feed_disable : db -> unit = "ml_sqlite3_change_feed_disable"
+external change_feed_drain   : db -> (change_op * string * int64) array array
+  = "ml_sqlite3_change_feed_drain"
+external change_feed_lost    : db -> int = "ml_sqlite3_change_feed_lost"
+
 
 external prepare : db -> string -> int -> stmt option * int = "ml_sqlite3_prepare"
 external reset : stmt -> unit = "ml_sqlite3_reset"
 external expired : stmt -> bool = "ml_sqlite3_expired"
 external step : stmt -> [`DONE|`ROW] = "ml_sqlite3_step"
+external step_blocking : stmt -> [`DONE|`ROW] = "ml_sqlite3_step_blocking"
 
 external bind : stmt -> int -> sql_value -> unit = "ml_sqlite3_bind"
 external bind_parameter_count : stmt -> int = "ml_sqlite3_bind_parameter_count"
@@ -175,6 +211,30 @@ external value_int    : argument -> int    = "ml_sqlite3_value_int"
 external value_int64  : argument -> int64  = "ml_sqlite3_value_int64"
 external value_text   : argument -> string = "ml_sqlite3_value_text"
 external value_type   : argument -> sql_type = "ml_sqlite3_value_type"
+
+(* The cached value is stored as a closure that writes it in the slot
+   of its key, so that reading it back with another key finds nothing
+   instead of a value of the wrong type. *)
+type 'a auxdata_key = { mutable slot : 'a option }
+external _get_auxdata : argument -> (unit -> unit) option = "ml_sqlite3_get_auxdata"
+external _set_auxdata : argument -> (unit -> unit) -> unit = "ml_sqlite3_set_auxdata"
+let auxdata_key () = { slot = None }
+let auxdata key arg f =
+  let cached =
+    match _get_auxdata arg with
+    | Some put ->
+	put () ;
+	let v = key.slot in
+	key.slot <- None ;
+	v
+    | None -> None in
+  match cached with
+  | Some v -> v
+  | None ->
+      let v = f arg in
+      let s = Some v in
+      _set_auxdata arg (fun () -> key.slot <- s) ;
+      v
 external _create_function : 
   db -> string -> int -> (argument array -> sql_value) -> unit
     = "ml_sqlite3_create_function"
@@ -196,6 +256,32 @@ let create_fun_3 db name f =
 
 external delete_function : db -> string -> unit = "ml_sqlite3_delete_function"
 
+external create_collation : 
+  db -> string -> (string -> int -> string -> int -> int) -> unit
+    = "ml_sqlite3_create_collation"
+type native_collation = [`NATURAL|`CASEFOLD|`REVERSE]
+external create_native_collation : db -> string -> native_collation -> unit
+  = "ml_sqlite3_create_native_collation"
+external delete_collation : db -> string -> unit = "ml_sqlite3_delete_collation"
+
+type fts5_reason = [`DOCUMENT|`QUERY|`PREFIX|`AUX]
+type fts5_context
+external fts5_create_tokenizer :
+  db -> string -> (string array -> fts5_reason -> string -> (string * int * int) array) -> unit
+  = "ml_sqlite3_fts5_create_tokenizer"
+external fts5_create_function :
+  db -> string -> (fts5_context -> argument array -> sql_value) -> unit
+  = "ml_sqlite3_fts5_create_function"
+external fts5_column_count : fts5_context -> int = "ml_sqlite3_fts5_column_count"
+external fts5_row_count : fts5_context -> int64 = "ml_sqlite3_fts5_row_count"
+external fts5_column_total_size : fts5_context -> int -> int64 = "ml_sqlite3_fts5_column_total_size"
+external fts5_column_size : fts5_context -> int -> int = "ml_sqlite3_fts5_column_size"
+external fts5_column_text : fts5_context -> int -> string = "ml_sqlite3_fts5_column_text"
+external fts5_phrase_count : fts5_context -> int = "ml_sqlite3_fts5_phrase_count"
+external fts5_phrase_size : fts5_context -> int -> int = "ml_sqlite3_fts5_phrase_size"
+external fts5_rowid : fts5_context -> int64 = "ml_sqlite3_fts5_rowid"
+external fts5_insts : fts5_context -> (int * int * int) array = "ml_sqlite3_fts5_insts"
+
 
 
 (* Higher-level functions manipulating statements *)
@@ -407,3 +493,39 @@ let transaction ?kind db f =
   with exn -> 
     begin try exec db "ROLLBACK" with _ -> () end ; 
     raise exn
+
+type snapshot
+external _snapshot_get : db -> string -> snapshot = "ml_sqlite3_snapshot_get"
+external _snapshot_open : db -> string -> snapshot -> unit = "ml_sqlite3_snapshot_open"
+external snapshot_cmp : snapshot -> snapshot -> int = "ml_sqlite3_snapshot_cmp"
+external snapshot_free : snapshot -> unit = "ml_sqlite3_snapshot_free"
+
+let snapshot_get ?(schema="main") db =
+  _snapshot_get db schema
+
+let snapshot_open ?(schema="main") db s =
+  _snapshot_open db schema s
+
+let quote_ident s =
+  let b = Buffer.create (String.length s + 2) in
+  Buffer.add_char b '"' ;
+  String.iter
+    (fun c -> 
+      if c = '"' then Buffer.add_char b '"' ;
+      Buffer.add_char b c)
+    s ;
+  Buffer.add_char b '"' ;
+  Buffer.contents b
+
+let snapshot ?(schema="main") db =
+  transaction db
+    (fun db ->
+      (* reading the header starts the read transaction *)
+      exec db (Printf.sprintf "PRAGMA %s.schema_version" (quote_ident schema)) ;
+      _snapshot_get db schema)
+
+let with_snapshot ?schema db s f =
+  transaction db
+    (fun db ->
+      snapshot_open ?schema db s ;
+      f db)
@@ -46,6 +46,10 @@ type error_code =
   | RANGE      (** 2nd parameter to [sqlite3_bind] out of range *)
   | NOTADB     (** File opened that is not a database file *)
 exception Error of error_code * string
+exception Timeout
+(** Raised by {!Sqlite3.step} when a statement exceeds the time limit set with 
+    {!Sqlite3.deadline_set}. Also raised by {!Sqlite3_io} and {!Sqlite3_cursor}, 
+    whose statements share the time limit of their connection. *)
 
 val version : string
 (** The [sqlite3] library version number. *)
@@ -57,8 +61,22 @@ val init : unit
 (** {2 Open/Close databases} *)
 
 external open_db : string -> db = "ml_sqlite3_open"
+external open_db_vfs : vfs:string -> string -> db = "ml_sqlite3_open_vfs"
+(** Open a database with the VFS named [vfs]. *)
 val close_db : db -> unit
 
+val memvfs_register : ?default:bool -> string -> unit
+(** [memvfs_register name] registers an in-memory VFS called [name], the 
+    default VFS if [default] is [true]. The files of all the memory VFS are 
+    kept in one registry, visible from all the connections of the process: 
+    they're shared like files on disk, with the same locking, and survive 
+    their connections until they're deleted. The WAL mode is supported. 
+    Use {!Sqlite3.open_db_vfs} to open a database with it. *)
+
+external memvfs_delete : string -> string -> unit = "ml_sqlite3_memvfs_delete"
+(** [memvfs_delete vfs name] deletes a file of the memory VFS [vfs]. Its 
+    memory is freed when the last connection using it is closed. *)
+
 val compileoption_get : unit -> string list
 
 external interrupt : db -> unit = "ml_sqlite3_interrupt"
@@ -77,16 +95,115 @@ external busy_set     : db -> (int -> [ `FAIL | `RETRY ]) -> unit = "ml_sqlite3_
 external busy_unset   : db -> unit = "ml_sqlite3_busy_handler_unset"
 external busy_timeout : db -> int -> unit = "ml_sqlite3_busy_timeout"
 
+val busy_backoff : ?base:int -> ?cap:int -> db -> int -> unit
+(** [busy_backoff ~base ~cap db timeout] sets a busy handler implemented in C, 
+    that does not call back into OCaml. The [n]-th retry sleeps a random time 
+    between half and all of [min cap (base * 2^n)] milliseconds, and the handler 
+    gives up after [timeout] milliseconds. [base] defaults to 1 and [cap] to 100.
+    Like {!Sqlite3.busy_set}, this replaces the previous busy handler. *)
+external busy_stats : db -> int * int * int = "ml_sqlite3_busy_stats"
+(** Counters of the {!Sqlite3.busy_backoff} handler: number of retries, number 
+    of times it gave up and total time waited in milliseconds. The counters are 
+    reset by {!Sqlite3.busy_backoff}. *)
+
 (** The [trace] callback *)
 
 external trace_set   : db -> (string -> unit) -> unit = "ml_sqlite3_trace"
 external trace_unset : db -> unit = "ml_sqlite3_trace_unset"
 
+(** The query log
+
+    A ring buffer of executed statements filled in C from [sqlite3_trace_v2], 
+    without calling back into OCaml. It uses the same hook as {!Sqlite3.trace_set}, 
+    so the two cannot be used together on a [db]: the last one set replaces the 
+    other. Disabling the log leaves a callback set afterwards in place. *)
+
+val query_log_enable : ?sample:int -> ?slow:int -> db -> int -> unit
+(** [query_log_enable ~sample ~slow db size] starts logging in a ring buffer 
+    of [size] entries; when it's full the oldest entries are overwritten.
+    Statements that ran for at least [slow] milliseconds are always logged, 
+    the others are logged once every [sample] statements. By default no 
+    statement is sampled and the slow threshold is disabled. *)
+external query_log_disable : db -> unit = "ml_sqlite3_query_log_disable"
+external query_log_drain : db -> (float * float * string * int) array = "ml_sqlite3_query_log_drain"
+(** Return the logged entries, oldest first, and empty the log. An entry is 
+    [(time, duration, sql, rows)]: completion time as given by [Unix.gettimeofday],
+    running time in seconds as estimated by sqlite, the text of the statement 
+    (truncated to 239 bytes) and the number of rows it returned, or [-1] if they 
+    could not be counted because more than 16 statements were running at once. *)
+
 (** The [progress] callback *)
 
 external progress_handler_set   : db -> int -> (unit -> unit) -> unit = "ml_sqlite3_progress_handler"
 external progress_handler_unset : db -> unit = "ml_sqlite3_progress_handler_unset"
 
+(** Deadlines and cancellation
+
+    These are checked in C from the progress handler of the connection, without 
+    calling back into OCaml. The handler is shared with {!Sqlite3.progress_handler_set}:
+    when an OCaml progress callback is set, its period is used. *)
+
+val deadline_set : ?period:int -> db -> int -> unit
+(** [deadline_set ~period db ms] limits each statement of [db] to [ms] 
+    milliseconds on the monotonic clock, counted from the start of its execution 
+    (its first step after a reset, or after it returned [`DONE]); a statement 
+    already running gets [ms] milliseconds from now. A cursor gets its time limit 
+    when it is opened. Statements still running after their deadline fail with the 
+    {!Sqlite3.Timeout} exception. The clock is checked every [period] virtual 
+    machine instructions (1000 by default). Any previous time limit or 
+    cancellation is cleared.
+
+    When several statements of [db] are interleaved, the deadline is that of the 
+    one started last. With an sqlite older than 3.7.10, without 
+    [sqlite3_stmt_busy], the time limit only starts again at {!Sqlite3.reset}. *)
+external deadline_clear : db -> unit = "ml_sqlite3_deadline_clear"
+(** Remove the time limit of [db] and clear a cancellation. *)
+
+type cancel_token
+external cancel_token : db -> cancel_token = "ml_sqlite3_cancel_token"
+(** Create a token that can cancel the statements running on [db]. *)
+external cancel : cancel_token -> unit = "ml_sqlite3_cancel"
+(** Mark the token as fired and call [sqlite3_interrupt] on the connection. 
+    The statement being executed fails with an [INTERRUPT] error, at its current 
+    or next step. The cancellation is forgotten when a statement starts a new 
+    execution (its first step after a reset, or after it returned [`DONE]) and
+    by {!Sqlite3.deadline_clear} and {!Sqlite3.deadline_set}: cancelling while no 
+    statement runs has no effect on the next one. Firing a token of a closed [db] 
+    does nothing.
+
+    This may be called from any thread. {!Sqlite3.step} releases the OCaml runtime 
+    lock when no OCaml callback (busy handler, trace, progress handler, function, 
+    collation or FTS5 tokenizer) is registered on the connection, and no change 
+    feed or query log is enabled; otherwise another OCaml thread can only fire the 
+    token between two steps or while a callback of the statement runs. *)
+
+(** The change feed
+
+    Changes to rowid tables are recorded by the update, commit and rollback
+    hooks in a fixed-size C ring buffer, without calling back into OCaml.
+    The changes of a transaction are published as one batch when it commits
+    and discarded if it rolls back.
+
+    SQLite does not call the rollback hook for [ROLLBACK TO] or when a single
+    statement aborts inside a transaction, so the feed may report rows whose
+    change was undone (e.g. by the per-job savepoints of {!Sqlite3_group});
+    {!Sqlite3_io.import} removes its own rolled back batches. Use it to
+    invalidate caches, not to replicate data. *)
+
+type change_op = [ `INSERT | `UPDATE | `DELETE ]
+
+external change_feed_enable  : db -> int -> unit = "ml_sqlite3_change_feed_enable"
+(** [change_feed_enable db size] installs the hooks, with a ring buffer holding
+    up to [size] changes. Any previous feed of [db] is discarded. *)
+external change_feed_disable : db -> unit = "ml_sqlite3_change_feed_disable"
+external change_feed_drain   : db -> (change_op * string * int64) array array = "ml_sqlite3_change_feed_drain"
+(** Return the published batches, oldest first, and remove them from the feed.
+    Each batch holds the [(op, table, rowid)] changes of one transaction. *)
+external change_feed_lost    : db -> int = "ml_sqlite3_change_feed_lost"
+(** Return the number of transactions dropped since the last call, either
+    because the ring buffer was full or because a single transaction did not
+    fit in it. A non-zero value means the feed is incomplete. *)
+
 (** {2 Compiled SQL statements } *)
 
 external finalize_stmt : stmt -> unit = "ml_sqlite3_finalize_noerr"
@@ -113,7 +230,16 @@ external expired : stmt -> bool = "ml_sqlite3_expired"
 external step : stmt -> [ `DONE | `ROW ] = "ml_sqlite3_step"
 (** Call [sqlite3_step] on the statement. In case of error, a
     {!Sqlite3.Error} exception is raised and the [stmt] is reset, except if the error 
-    is [BUSY] or [MISUSE]. *)
+    is [BUSY] or [MISUSE]. The runtime lock is released during the step if no OCaml 
+    code can run from it, see {!Sqlite3.cancel}. *)
+
+external step_blocking : stmt -> [ `DONE | `ROW ] = "ml_sqlite3_step_blocking"
+(** Same as {!Sqlite3.step}, but in shared-cache mode, when a table is locked by 
+    another connection, wait with [sqlite3_unlock_notify] until that connection 
+    ends its transaction, then retry. The runtime lock is released while waiting.
+    A [LOCKED] error is raised if waiting would deadlock.
+
+    This requires a sqlite library compiled with [SQLITE_ENABLE_UNLOCK_NOTIFY]. *)
 
 (** {3 SQL parameter binding} *)
 
@@ -148,6 +274,17 @@ external value_int64  : argument -> int64 = "ml_sqlite3_value_int64"
 external value_text   : argument -> string = "ml_sqlite3_value_text"
 external value_type   : argument -> sql_type = "ml_sqlite3_value_type"
 
+type 'a auxdata_key
+val auxdata_key : unit -> 'a auxdata_key
+(** A key for the values of type ['a] cached with {!Sqlite3.auxdata} *)
+val auxdata : 'a auxdata_key -> argument -> (argument -> 'a) -> 'a
+(** [auxdata key arg f] returns the value computed by [f arg], cached by SQLite
+    while [arg] stays the same, typically a constant argument of the function 
+    in a statement. Use it for values derived from the argument that are 
+    expensive to compute, like a compiled pattern. The cache is per argument 
+    and per call site; a value cached with another key is ignored and 
+    replaced. Not available for FTS5 auxiliary functions. *)
+
 (** {3 Registration} *)
 
 val create_fun_N : db -> string -> (argument array -> sql_value) -> unit
@@ -158,6 +295,75 @@ val create_fun_3 : db -> string -> (argument -> argument -> argument -> sql_valu
 
 external delete_function : db -> string -> unit = "ml_sqlite3_delete_function"
 
+(** {2 Collations } *)
+
+external create_collation : db -> string -> (string -> int -> string -> int -> int) -> unit = "ml_sqlite3_create_collation"
+(** [create_collation db name cmp] registers the collating sequence [name].
+    [cmp s1 len1 s2 len2] compares the first [len1] bytes of [s1] with the
+    first [len2] bytes of [s2]. The two strings are scratch buffers reused 
+    across comparisons: they may be longer than the operands and must not be 
+    kept or modified by [cmp]. An exception raised by [cmp] interrupts the 
+    statement and is raised by {!Sqlite3.step}. *)
+
+type native_collation = [ `NATURAL | `CASEFOLD | `REVERSE ]
+(** Collations implemented in C:
+    - [`NATURAL]: runs of digits compare by numeric value (["a2" < "a10"]), 
+      other bytes compare bytewise
+    - [`CASEFOLD]: shorter strings sort first, strings of equal length compare
+      ASCII case-insensitively. Equality is the same as with [NOCASE] but 
+      operands of different lengths are decided without looking at the bytes.
+    - [`REVERSE]: bytewise comparison starting from the end of the strings, 
+      for indexes on suffixes *)
+
+external create_native_collation : db -> string -> native_collation -> unit = "ml_sqlite3_create_native_collation"
+(** [create_native_collation db name kind] registers the native collation [kind]
+    under [name]. Note that [NATURAL] is a SQL keyword and cannot be used as an 
+    unquoted collation name. *)
+external delete_collation : db -> string -> unit = "ml_sqlite3_delete_collation"
+
+(** {2 FTS5 } *)
+
+type fts5_reason = [ `DOCUMENT | `QUERY | `PREFIX | `AUX ]
+(** Why a text is tokenized: for a document being inserted or deleted, for a 
+    [MATCH] query, for a prefix query term, or at the request of an auxiliary 
+    function *)
+
+external fts5_create_tokenizer :
+  db -> string -> (string array -> fts5_reason -> string -> (string * int * int) array) -> unit
+  = "ml_sqlite3_fts5_create_tokenizer"
+(** [fts5_create_tokenizer db name create] registers an FTS5 tokenizer. 
+    [create args] is called with the arguments of the tokenizer in the 
+    [tokenize] option of the table and returns the tokenizing function. It is 
+    called once per text and returns all its tokens, with the byte offsets of 
+    their start and end in the text. An exception raised by [create] or the 
+    tokenizing function makes the statement fail. *)
+
+type fts5_context
+
+external fts5_create_function :
+  db -> string -> (fts5_context -> argument array -> sql_value) -> unit
+  = "ml_sqlite3_fts5_create_function"
+(** [fts5_create_function db name f] registers an FTS5 auxiliary function. [f] 
+    is called for each row with a context giving access to the matches and 
+    the arguments of the function after the table name. The context is only 
+    valid during the call. *)
+
+external fts5_column_count : fts5_context -> int = "ml_sqlite3_fts5_column_count"
+external fts5_row_count : fts5_context -> int64 = "ml_sqlite3_fts5_row_count"
+external fts5_column_total_size : fts5_context -> int -> int64 = "ml_sqlite3_fts5_column_total_size"
+(** Total number of tokens in a column of the table, in all columns if the 
+    column is negative *)
+external fts5_column_size : fts5_context -> int -> int = "ml_sqlite3_fts5_column_size"
+(** Number of tokens in a column of the current row, in all columns if the 
+    column is negative *)
+external fts5_column_text : fts5_context -> int -> string = "ml_sqlite3_fts5_column_text"
+external fts5_phrase_count : fts5_context -> int = "ml_sqlite3_fts5_phrase_count"
+external fts5_phrase_size : fts5_context -> int -> int = "ml_sqlite3_fts5_phrase_size"
+external fts5_rowid : fts5_context -> int64 = "ml_sqlite3_fts5_rowid"
+external fts5_insts : fts5_context -> (int * int * int) array = "ml_sqlite3_fts5_insts"
+(** All the phrase instances of the current row, as 
+    [(phrase, column, token offset)] *)
+
 
 (** {2 High-level functions} *)
 
@@ -229,3 +435,37 @@ val transaction :
 (** Evaluate a function within a transaction. [BEGIN] is executed, then the function 
     argument is applied to the [db], then [COMMIT] is executed and the result of the
     function is returned. If the function raises an exception, [ROLLACK] is executed. *)
+
+(** {2 Snapshots} *)
+
+(** A snapshot identifies a state of a database in WAL mode. It can be opened 
+    by other connections to the same database, so that several read 
+    transactions see the same data. The WAL frames of a snapshot may be 
+    checkpointed once no transaction uses them, after which the snapshot 
+    can't be opened anymore. Snapshots need a SQLite compiled with 
+    [SQLITE_ENABLE_SNAPSHOT]. *)
+
+type snapshot
+
+val snapshot_get : ?schema:string -> db -> snapshot
+(** Record the state seen by the current read transaction of [db] on 
+    [schema] (["main"] by default). *)
+
+val snapshot_open : ?schema:string -> db -> snapshot -> unit
+(** Make the transaction just opened on [db] read the state of the 
+    snapshot. It must be called after [BEGIN] and before any read. *)
+
+external snapshot_cmp : snapshot -> snapshot -> int = "ml_sqlite3_snapshot_cmp"
+(** Compare the ages of two snapshots of the same database: negative if the 
+    first one is older. *)
+
+external snapshot_free : snapshot -> unit = "ml_sqlite3_snapshot_free"
+(** Free a snapshot. Snapshots are freed when they are garbage collected. *)
+
+val snapshot : ?schema:string -> db -> snapshot
+(** Take a snapshot of the current state of the database, in a short read 
+    transaction. *)
+
+val with_snapshot : ?schema:string -> db -> snapshot -> (db -> 'a) -> 'a
+(** [with_snapshot db s f] evaluates [f db] in a transaction reading the 
+    snapshot [s], like {!Sqlite3.transaction}. *)
@@ -5,3 +5,10 @@ type t = (char, int8_unsigned_elt, c_layout) Array1.t
 
 external bind : stmt -> int -> t -> unit = "ml_sqlite3_bind_blob_big"
 external column_blob : stmt -> int -> t = "ml_sqlite3_column_blob_big"
+
+external register_array : db -> unit = "ml_sqlite3_array_register"
+external bind_int64_array : 
+  stmt -> int -> (int64, int64_elt, c_layout) Array1.t -> unit = "ml_sqlite3_bind_int64_array"
+external bind_float_array : 
+  stmt -> int -> (float, float64_elt, c_layout) Array1.t -> unit = "ml_sqlite3_bind_float_array"
+external bind_text_array : stmt -> int -> string array -> unit = "ml_sqlite3_bind_text_array"
@@ -5,3 +5,24 @@ type t = (char, int8_unsigned_elt, c_layout) Array1.t
 
 external bind : stmt -> int -> t -> unit = "ml_sqlite3_bind_blob_big"
 external column_blob : stmt -> int -> t = "ml_sqlite3_column_blob_big"
+
+(** {2 Array parameters} *)
+
+external register_array : db -> unit = "ml_sqlite3_array_register"
+(** Register the table-valued function [ml_array] on a connection. 
+    [ml_array(?1)] returns the elements of the array bound to the parameter 
+    [?1] in a [value] column, so that a list of values can be passed as a 
+    single parameter, as in [SELECT * FROM t WHERE id IN ml_array(?1)]: 
+    the statement is prepared once for any number of values. Without an 
+    array bound, [ml_array] is empty. *)
+
+external bind_int64_array : 
+  stmt -> int -> (int64, int64_elt, c_layout) Array1.t -> unit = "ml_sqlite3_bind_int64_array"
+external bind_float_array : 
+  stmt -> int -> (float, float64_elt, c_layout) Array1.t -> unit = "ml_sqlite3_bind_float_array"
+(** Bind a bigarray for [ml_array]. The elements are read in place by SQLite: 
+    the bigarray must not be modified while the statement runs. *)
+
+external bind_text_array : stmt -> int -> string array -> unit = "ml_sqlite3_bind_text_array"
+(** Bind an array of strings for [ml_array], as [TEXT]. The strings are 
+    copied. *)
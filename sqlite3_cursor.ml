@@ -0,0 +1,108 @@
+open Sqlite3
+
+type t
+
+external _create : db -> string -> int -> int -> t = "ml_sqlite3_cursor_open"
+external bind  : t -> int -> sql_value -> unit = "ml_sqlite3_cursor_bind"
+external start : t -> unit = "ml_sqlite3_cursor_start"
+external _snapshot : t -> snapshot -> unit = "ml_sqlite3_cursor_snapshot"
+external next  : t -> sql_value array array = "ml_sqlite3_cursor_next"
+external close : t -> unit = "ml_sqlite3_cursor_close"
+
+let create ?(batch=256) ?(depth=2) ?snapshot db sql =
+  let c = _create db sql batch depth in
+  begin match snapshot with
+  | Some s -> 
+      begin try _snapshot c s
+      with exn -> close c ; raise exn end
+  | None -> ()
+  end ;
+  c
+
+let fold f init c =
+  start c ;
+  let rec loop acc =
+    match next c with
+    | [||] -> acc
+    | rows -> loop (Array.fold_left f acc rows) in
+  loop init
+
+let iter f c =
+  fold (fun () row -> f row) () c
+
+(* Split [lo, hi] in at most [parts] ranges of equal width. The width 
+   hi - lo may not fit in an int64: (hi - lo) / parts is computed from 
+   hi / parts and lo / parts, and distances are compared as unsigned. *)
+let ranges parts lo hi =
+  let n = Int64.of_int parts in
+  let floor_div r =
+    if r >= 0L then Int64.div r n
+    else Int64.neg (Int64.div (Int64.sub (Int64.sub n 1L) r) n) in
+  let width =
+    Int64.add
+      (Int64.sub (Int64.div hi n) (Int64.div lo n))
+      (floor_div (Int64.sub (Int64.rem hi n) (Int64.rem lo n))) in
+  let unsigned_lt a b =
+    Int64.compare (Int64.add a Int64.min_int) (Int64.add b Int64.min_int) < 0 in
+  let rec loop acc a =
+    let b =
+      if unsigned_lt width (Int64.sub hi a)
+      then Int64.add a width
+      else hi in
+    if b = hi
+    then List.rev ((a, b) :: acc)
+    else loop ((a, b) :: acc) (Int64.succ b) in
+  if parts = 1 then [ (lo, hi) ] else loop [] lo
+
+let scan ?(parts=4) ?batch ?depth ?snapshot db ~bounds sql f init combine =
+  if parts <= 0 then invalid_arg "Sqlite3_cursor.scan" ;
+  let get_bounds db =
+    fetch db bounds
+      (fun _ stmt ->
+	match column_type stmt 0, column_type stmt 1 with
+	| `NULL, _ | _, `NULL -> None
+	| _ -> Some (column_int64 stmt 0, column_int64 stmt 1))
+      None in
+  let b =
+    match snapshot with
+    | Some s -> with_snapshot db s get_bounds
+    | None -> get_bounds db in
+  match b with
+  | None -> init
+  | Some (lo, hi) when lo > hi -> init
+  | Some (lo, hi) ->
+      let cursors = ref [] in
+      try
+	List.iter
+	  (fun (a, b) ->
+	    let c = create ?batch ?depth ?snapshot db sql in
+	    cursors := c :: !cursors ;
+	    bind c 1 (`INT64 a) ;
+	    bind c 2 (`INT64 b))
+	  (ranges parts lo hi) ;
+	let cursors = Array.of_list (List.rev !cursors) in
+	Array.iter start cursors ;
+	let acc  = Array.make (Array.length cursors) init in
+	let live = Array.make (Array.length cursors) true in
+	let left = ref (Array.length cursors) in
+	while !left > 0 do
+	  Array.iteri
+	    (fun i c ->
+	      if live.(i) then
+		match next c with
+		| [||] -> 
+		    live.(i) <- false ;
+		    decr left
+		| rows ->
+		    acc.(i) <- Array.fold_left f acc.(i) rows)
+	    cursors
+	done ;
+	Array.iter close cursors ;
+	let r = ref acc.(0) in
+	for i = 1 to Array.length acc - 1 do
+	  r := combine !r acc.(i)
+	done ;
+	!r
+      with exn ->
+	List.iter close !cursors ;
+	raise exn
@@ -0,0 +1,74 @@
+(** Prefetching cursors *)
+
+(** A cursor executes a [SELECT] in a C thread, on a separate read-only 
+    connection to the same database file. The rows are copied into a ring of 
+    [depth] batches of [batch] rows each, so that the thread steps the 
+    statement while the program processes the previous batches. The thread 
+    stops when all the batches are full and resumes as they are consumed. 
+
+    Since the cursor has its own connection, it doesn't see the uncommitted 
+    changes of the original connection, and it cannot be used with [:memory:] 
+    or temporary databases. Databases of the memory VFS 
+    ({!Sqlite3.memvfs_register}) can be used. *)
+
+type t
+
+val create : 
+  ?batch:int -> ?depth:int -> ?snapshot:Sqlite3.snapshot -> Sqlite3.db -> string -> t
+(** [create db sql] opens a cursor on the database file of [db] and prepares 
+    [sql]. [batch] is the number of rows per batch (256 by default) and [depth] 
+    the number of batches (2 by default). If [snapshot] is given, the 
+    statement reads the state of this snapshot. The statement doesn't run 
+    until {!Sqlite3_cursor.start} is called. *)
+
+val bind : t -> int -> Sqlite3.sql_value -> unit
+(** Bind a parameter of the cursor statement; only before 
+    {!Sqlite3_cursor.start}. *)
+
+val start : t -> unit
+(** Start the prefetching thread. Does nothing if it's already started. *)
+
+val next : t -> Sqlite3.sql_value array array
+(** Return the next batch of rows, waiting for the thread if it's not ready. 
+    Return an empty array at the end of the result. Integers are returned as 
+    [`INT] when they fit in an OCaml [int] and [`INT64] otherwise. SQL errors 
+    raise {!Sqlite3.Error}, after the rows read before the error have been 
+    returned. *)
+
+val close : t -> unit
+(** Stop the thread, interrupting the statement if needed, and close the 
+    connection of the cursor. Unclosed cursors are closed when they're 
+    garbage collected. *)
+
+val fold : ('a -> Sqlite3.sql_value array -> 'a) -> 'a -> t -> 'a
+(** [fold f init c] starts [c] and folds [f] over all its rows. The cursor 
+    isn't closed. *)
+
+val iter : (Sqlite3.sql_value array -> unit) -> t -> unit
+
+(** {2 Parallel scans} *)
+
+val scan :
+  ?parts:int -> ?batch:int -> ?depth:int -> ?snapshot:Sqlite3.snapshot -> Sqlite3.db -> 
+  bounds:string -> string ->
+  ('a -> Sqlite3.sql_value array -> 'a) -> 'a -> ('a -> 'a -> 'a) -> 'a
+(** [scan db ~bounds sql f init combine] runs [sql] over [parts] ranges of an 
+    integer key (4 by default) with one cursor per range, so that the 
+    statements are stepped in parallel. 
+
+    [bounds] is a query returning the minimum and maximum of the key, for 
+    instance ["SELECT min(rowid), max(rowid) FROM t"]; the interval is split 
+    in [parts] ranges of equal width. [sql] must select on the key with 
+    parameters [?1] and [?2] as the inclusive bounds of a range, for instance 
+    ["SELECT sum(x) FROM t WHERE rowid BETWEEN ?1 AND ?2"]. 
+
+    [f] folds the rows of each range from [init] and the partial results are 
+    merged with [combine], in the order of the ranges. Only the stepping of the 
+    statements runs in parallel: [f] is called from the current thread, as 
+    the batches become available. If [bounds] returns [NULL], [init] is 
+    returned.
+
+    Each cursor starts its own read transaction, so the ranges may see 
+    different states of the database if it is written to during the scan, 
+    unless a [snapshot] is given (see {!Sqlite3.snapshot}). In WAL mode, the 
+    writers are not blocked by the scan. *)
@@ -0,0 +1,170 @@
+open Sqlite3
+
+type state =
+  | Pending
+  | Done of int64 * int
+  | Failed of exn
+
+type job = {
+    stmt : stmt ;
+    bindings : sql_value list ;
+    mutable state : state ;
+  }
+
+type t = {
+    db : db ;
+    max_batch : int ;
+    max_delay : float ;
+    queue : job Queue.t ;
+    mutex : Mutex.t ;
+    submitted : Condition.t ;
+    completed : Condition.t ;
+    armed : Condition.t ;
+    mutable deadline : float option ;
+    mutable stopped : bool ;
+    mutable writer : Thread.t option ;
+    mutable timer : Thread.t option ;
+    savepoint : stmt ;
+    release : stmt ;
+    rollback_to : stmt ;
+  }
+
+(* monotonic clock, in seconds *)
+external now : unit -> float = "ml_sqlite3_monotonic"
+
+let run_stmt s =
+  reset s ;
+  do_step s
+
+let run_job g db j =
+  run_stmt g.savepoint ;
+  try
+    bind_and_exec j.stmt j.bindings ;
+    let r = Done (last_insert_rowid db, changes db) in
+    run_stmt g.release ;
+    r
+  with exn ->
+    begin try reset j.stmt with _ -> () end ;
+    run_stmt g.rollback_to ;
+    run_stmt g.release ;
+    Failed exn
+
+let run_batch g jobs =
+  let results =
+    try
+      transaction ~kind:`IMMEDIATE g.db
+	(fun db -> List.map (run_job g db) jobs)
+    with exn ->
+      List.map (fun _ -> Failed exn) jobs in
+  Mutex.lock g.mutex ;
+  List.iter2 (fun j r -> j.state <- r) jobs results ;
+  Condition.broadcast g.completed ;
+  Mutex.unlock g.mutex
+
+(* The timer thread sleeps until the deadline of the batch being
+   gathered, then wakes the writer. Called with the mutex held. *)
+let rec timer g =
+  match g.deadline with
+  | None when g.stopped -> ()
+  | None ->
+      Condition.wait g.armed g.mutex ;
+      timer g
+  | Some d ->
+      Mutex.unlock g.mutex ;
+      let left = d -. now () in
+      if left > 0. then Thread.delay left ;
+      Mutex.lock g.mutex ;
+      if g.deadline = Some d then begin
+	g.deadline <- None ;
+	Condition.signal g.submitted
+      end ;
+      timer g
+
+(* Wait, woken by submit or by the timer, until the queue holds a
+   full batch or the deadline is past. Called with the mutex held. *)
+let take g =
+  if g.max_delay > 0. then begin
+    let d = now () +. g.max_delay in
+    g.deadline <- Some d ;
+    Condition.signal g.armed ;
+    while Queue.length g.queue < g.max_batch
+	&& not g.stopped && g.deadline = Some d do
+      Condition.wait g.submitted g.mutex
+    done ;
+    g.deadline <- None
+  end ;
+  let rec loop acc n =
+    if n >= g.max_batch || Queue.is_empty g.queue
+    then List.rev acc
+    else loop (Queue.take g.queue :: acc) (n + 1) in
+  loop [] 0
+
+let rec writer g =
+  Mutex.lock g.mutex ;
+  while Queue.is_empty g.queue && not g.stopped do
+    Condition.wait g.submitted g.mutex
+  done ;
+  if Queue.is_empty g.queue
+  then Mutex.unlock g.mutex
+  else begin
+    let jobs = take g in
+    Mutex.unlock g.mutex ;
+    run_batch g jobs ;
+    writer g
+  end
+
+let create ?(max_batch=256) ?(max_delay=0.002) db =
+  if max_batch <= 0 || max_delay < 0. then invalid_arg "Sqlite3_group.create" ;
+  let g = {
+    db = db ; max_batch = max_batch ; max_delay = max_delay ;
+    queue = Queue.create () ;
+    mutex = Mutex.create () ;
+    submitted = Condition.create () ;
+    completed = Condition.create () ;
+    armed = Condition.create () ;
+    deadline = None ;
+    stopped = false ; writer = None ; timer = None ;
+    savepoint = prepare_one db "SAVEPOINT sqlite3_group" ;
+    release = prepare_one db "RELEASE sqlite3_group" ;
+    rollback_to = prepare_one db "ROLLBACK TO sqlite3_group" } in
+  g.writer <- Some (Thread.create writer g) ;
+  g.timer <- Some (Thread.create
+		     (fun g -> Mutex.lock g.mutex ; timer g ; Mutex.unlock g.mutex) g) ;
+  g
+
+let submit g stmt bindings =
+  let j = { stmt = stmt ; bindings = bindings ; state = Pending } in
+  Mutex.lock g.mutex ;
+  if g.stopped then begin
+    Mutex.unlock g.mutex ;
+    invalid_arg "Sqlite3_group.submit"
+  end ;
+  Queue.add j g.queue ;
+  Condition.signal g.submitted ;
+  Mutex.unlock g.mutex ;
+  j
+
+let wait g j =
+  Mutex.lock g.mutex ;
+  while (match j.state with Pending -> true | _ -> false) do
+    Condition.wait g.completed g.mutex
+  done ;
+  Mutex.unlock g.mutex ;
+  match j.state with
+  | Done (rowid, changes) -> (rowid, changes)
+  | Failed exn -> raise exn
+  | Pending -> assert false
+
+let write g stmt bindings =
+  wait g (submit g stmt bindings)
+
+let shutdown g =
+  Mutex.lock g.mutex ;
+  g.stopped <- true ;
+  Condition.signal g.submitted ;
+  Condition.signal g.armed ;
+  let threads = [ g.writer ; g.timer ] in
+  g.writer <- None ;
+  g.timer <- None ;
+  Mutex.unlock g.mutex ;
+  List.iter (function Some t -> Thread.join t | None -> ()) threads
@@ -0,0 +1,36 @@
+(** Group commit *)
+
+(** A coalescer executes the writes submitted by several threads on one 
+    connection, grouping them in [IMMEDIATE] transactions so that a batch of 
+    writes costs a single commit. This module requires the threads library. *)
+
+type t
+type job
+
+val create : ?max_batch:int -> ?max_delay:float -> Sqlite3.db -> t
+(** [create db] starts a writer thread executing the submitted writes on 
+    [db], and a timer thread waking it when [max_delay] expires. A transaction is committed when it holds [max_batch] writes (256 by 
+    default) or [max_delay] seconds after its first write was taken (2ms by 
+    default), whichever comes first. The [db] must not be used by other 
+    threads while the coalescer runs. *)
+
+val submit : t -> Sqlite3.stmt -> Sqlite3.sql_value list -> job
+(** [submit g stmt values] queues a write: the writer will reset [stmt], bind 
+    [values] and execute it. [stmt] must be a statement of the coalescer 
+    connection; it may be shared by several threads since only the writer 
+    binds and steps it. *)
+
+val wait : t -> job -> int64 * int
+(** Wait for the transaction of a job to be committed and return the 
+    [last_insert_rowid] and the number of [changes] of the write. Each write 
+    runs in its own savepoint: if it fails, it's rolled back alone and [wait] 
+    raises its exception, the other writes of the batch are still committed. 
+    If the transaction itself fails, [wait] raises the exception for all the 
+    writes of the batch. *)
+
+val write : t -> Sqlite3.stmt -> Sqlite3.sql_value list -> int64 * int
+(** Combines {!Sqlite3_group.submit} and {!Sqlite3_group.wait} *)
+
+val shutdown : t -> unit
+(** Execute the queued writes and stop the writer thread. Subsequent calls to 
+    {!Sqlite3_group.submit} raise [Invalid_argument]. *)
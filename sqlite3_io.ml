@@ -0,0 +1,31 @@
+open Sqlite3
+
+exception Error of int * int * string
+
+let init =
+  Callback.register_exception "mlsqlite3_io_exn" (Error (0, 0, ""))
+
+external _import : 
+  stmt -> char -> bool -> bool -> string option -> int -> string -> int * float
+    = "ml_sqlite3_import_bc" "ml_sqlite3_import"
+
+let import ?(sep=',') ?(quote=true) ?(header=false) ?null ?(batch=10000) stmt path =
+  _import stmt sep quote header null batch path
+
+type format = [`CSV|`JSON|`BINARY]
+
+external _export : stmt -> format -> bool -> int -> string -> int * int
+  = "ml_sqlite3_export_file"
+external _export_to : stmt -> format -> bool -> int -> (string -> unit) -> int * int
+  = "ml_sqlite3_export_writer"
+external _export_string : stmt -> format -> bool -> string
+  = "ml_sqlite3_export_string"
+
+let export ?(format=`CSV) ?(header=false) ?(flush=65536) stmt path =
+  _export stmt format header flush path
+
+let export_to ?(format=`CSV) ?(header=false) ?(flush=65536) stmt write =
+  _export_to stmt format header flush write
+
+let export_string ?(format=`CSV) ?(header=false) stmt =
+  _export_string stmt format header
@@ -0,0 +1,65 @@
+(** Bulk import and export of data, in C *)
+
+exception Error of int * int * string
+(** Raised with the line number (or [0]), the number of rows imported or 
+    exported before the error and an error message *)
+
+val import :
+  ?sep:char -> ?quote:bool -> ?header:bool -> ?null:string -> ?batch:int ->
+  Sqlite3.stmt -> string -> int * float
+(** [import stmt path] reads the CSV file [path] and executes the 
+    prepared [stmt] (typically an [INSERT]) once for each record, binding the 
+    fields as [TEXT] parameters. The file is parsed in C and the fields are 
+    bound without copying. Returns the number of rows inserted and the number 
+    of rows per second.
+
+    - [sep] is the field separator, [','] by default ([ '\t' ] for TSV)
+    - if [quote] is [true] (the default), fields may be enclosed in double 
+      quotes, with doubled quotes inside
+    - if [header] is [true], the first record is skipped
+    - unquoted fields equal to [null] are bound as [NULL]
+    - [batch] is the number of rows per savepoint, 10000 by default. Outside 
+      of a transaction, each savepoint is a transaction of its own; if a 
+      transaction is already open, the savepoints are nested in it.
+
+    Empty lines are skipped. Each record must have as many fields as [stmt] 
+    has parameters. In case of error, {!Sqlite3_io.Error} is raised with the line 
+    of the offending record and the number of rows kept; the current batch is 
+    rolled back to its savepoint, and its changes removed from the change feed 
+    ({!Sqlite3.change_feed_enable}), but the previous ones remain (committed, or 
+    part of the open transaction). *)
+
+type format = [ `CSV | `JSON | `BINARY ]
+(** Output formats of {!Sqlite3_io.export}:
+    - [`CSV]: fields separated by [','], quoted when needed, records ended by 
+      ['\n']. [NULL] is written as an empty field.
+    - [`JSON]: JSON Lines, one object per row with the column names as keys
+    - [`BINARY]: each row is a 32-bit length followed by the columns; a column 
+      is its type code as a byte (1 integer, 2 float, 3 text, 4 blob, 5 null) 
+      followed by a 64-bit integer, a 64-bit IEEE float, or a 32-bit length and 
+      the bytes for text and blobs. Numbers are little-endian.
+
+    In [`CSV] and [`JSON], blobs are written in hexadecimal. *)
+
+val export :
+  ?format:format -> ?header:bool -> ?flush:int -> Sqlite3.stmt -> string -> int * int
+(** [export stmt path] executes [stmt] and writes the rows to the file [path], 
+    without creating OCaml values for them. The rows are serialized in C into a 
+    buffer written to the file every [flush] bytes (64KB by default), so memory 
+    use does not depend on the size of the result. If [header] is [true], a line 
+    with the column names is written first ([`CSV] only). The [stmt] is reset 
+    afterwards. Returns the number of rows and the number of bytes written. 
+
+    SQL errors raise {!Sqlite3.Error}, I/O errors raise {!Sqlite3_io.Error}. *)
+
+val export_to :
+  ?format:format -> ?header:bool -> ?flush:int -> Sqlite3.stmt -> 
+  (string -> unit) -> int * int
+(** [export_to stmt write] is {!Sqlite3_io.export} with the output passed in 
+    chunks of about [flush] bytes to [write] instead of a file, e.g. to write to 
+    an open socket or pipe, which is neither opened nor closed. [write] is called 
+    while [stmt] is running and must not use it; an exception raised by [write] 
+    resets [stmt] and is raised again by [export_to]. *)
+
+val export_string : ?format:format -> ?header:bool -> Sqlite3.stmt -> string
+(** Same as {!Sqlite3_io.export} but return the output as a string. *)
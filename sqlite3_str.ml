@@ -2,15 +2,84 @@
 let sql_value_of_bool b =
   if b then `INT 1 else `INT 0
 
-let sqlite_regexp arg_p arg_t =
+(* LRU cache of compiled patterns, for patterns that are not constant 
+   in a statement. The entries are also kept in a doubly-linked list 
+   from the newest to the oldest, so that a hit and an eviction take 
+   constant time. *)
+type entry = {
+    pattern : string ;
+    regexp : Str.regexp ;
+    mutable newer : entry option ;
+    mutable older : entry option ;
+  }
+
+type cache = {
+    size : int ;
+    tbl : (string, entry) Hashtbl.t ;
+    mutable newest : entry option ;
+    mutable oldest : entry option ;
+  }
+
+let unlink c e =
+  begin match e.newer with
+  | Some n -> n.older <- e.older
+  | None -> c.newest <- e.older
+  end ;
+  begin match e.older with
+  | Some o -> o.newer <- e.newer
+  | None -> c.oldest <- e.newer
+  end ;
+  e.newer <- None ;
+  e.older <- None
+
+let push c e =
+  e.older <- c.newest ;
+  begin match c.newest with
+  | Some n -> n.newer <- Some e
+  | None -> c.oldest <- Some e
+  end ;
+  c.newest <- Some e
+
+let cache_find c p =
+  try
+    let e = Hashtbl.find c.tbl p in
+    unlink c e ;
+    push c e ;
+    e.regexp
+  with Not_found ->
+    if Hashtbl.length c.tbl >= c.size then begin
+      match c.oldest with
+      | Some o ->
+	  unlink c o ;
+	  Hashtbl.remove c.tbl o.pattern
+      | None -> ()
+    end ;
+    let e = { pattern = p ; regexp = Str.regexp p ; newer = None ; older = None } in
+    Hashtbl.add c.tbl p e ;
+    push c e ;
+    e.regexp
+
+let compile cache arg_p =
   let p = Sqlite3.value_text arg_p in
+  match cache with
+  | Some c -> cache_find c p
+  | None -> Str.regexp p
+
+let compiled = Sqlite3.auxdata_key ()
+
+let sqlite_regexp cache arg_p arg_t =
+  let r = Sqlite3.auxdata compiled arg_p (compile cache) in
   let t = Sqlite3.value_text arg_t in
   sql_value_of_bool
-    (Str.string_match 
-       (Str.regexp p) t 0)
+    (Str.string_match r t 0)
 
-let register db =
-  Sqlite3.create_fun_2 db "regexp" sqlite_regexp
+let register ?(cache=0) db =
+  let c =
+    if cache > 0
+    then Some { size = cache ; tbl = Hashtbl.create cache ;
+		newest = None ; oldest = None }
+    else None in
+  Sqlite3.create_fun_2 db "regexp" (sqlite_regexp c)
 
 let unregister db =
   Sqlite3.delete_function db "regexp"
@@ -1,4 +1,8 @@
 (** Implement the [REGEXP] SQL operator using OCaml [Str] module *)
 
-val register   : Sqlite3.db -> unit
+val register   : ?cache:int -> Sqlite3.db -> unit
+(** The pattern is compiled once per statement when it is constant. 
+    Patterns that vary from row to row are compiled for each row, unless 
+    [cache] is the size of an LRU cache of compiled patterns for this 
+    connection (none by default). *)
 val unregister : Sqlite3.db -> unit